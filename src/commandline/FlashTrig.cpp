@@ -1,35 +1,450 @@
 #include <iostream>
+#include <vector>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/hidraw.h>
+#include <linux/usbdevice_fs.h>
 
 using namespace std;
 
+/* unix socket of flashtrig-broker, which passes opened device nodes to unprivileged processes */
+#define FT_BROKER_SOCKET	"/run/flashtrig.sock"
+
+/* one timed event of a sequence, played by the controller */
+struct SeqEvent
+{
+	uint8_t action;		// FT_SEQ_*
+	uint32_t offsetMs;	// from the start of the run
+	uint32_t param;		// flash time in us for the flash actions
+};
+
+struct FrameStatus
+{
+	uint16_t frame;		// usb frames counted by the device
+	uint8_t state;		// FT_FRAME_*
+	uint16_t target;	// frame the armed shot is fired at
+	uint16_t fireTicks;	// device timer ticks from the stamped frame start to the edge of the outputs
+};
+
+/* one query of the device time, host times in us on the steady clock */
+struct ClockSample
+{
+	double hostSendUs;
+	double hostRecvUs;
+	uint64_t deviceTicks;	// unwrapped device time
+};
+
+struct SeqStatus
+{
+	uint8_t state;		// FT_SEQ_STATE_*
+	uint8_t index;		// next event to be played
+	uint16_t runs;		// finished runs
+	uint32_t elapsedMs;	// into the current run
+};
+
+/* one edge of the external trigger input, reported by the device */
+struct ExtEvent
+{
+	uint8_t count;		// wraps, a gap means lost reports
+	uint32_t deviceTime;	// of the edge, in timer ticks
+	uint16_t fireTicks;	// from the edge to the fired outputs
+	double fireUs;
+	chrono::steady_clock::time_point received;	// host time the report arrived
+};
+
+struct ExtStatus
+{
+	uint8_t flags;		// FT_EXT_*, the enable flag is cleared after a single shot
+	uint16_t debounceMs;
+	ExtEvent last;		// count 0 until the first edge
+};
+
+/* distribution of the measured delays from trigger to flash sync, in us */
+struct ShutterLag
+{
+	int samples;		// up to FT_LAG_SAMPLES of the last shots
+	double minUs;
+	double medianUs;
+	double maxUs;
+	double meanUs;
+};
+
+/* the state of the controller, from a single FT_CMD_STATUS transfer */
+struct DeviceStatus
+{
+	uint8_t version;	// FT_STATUS_VERSION of the device
+	uint8_t channels;	// active channels, FT_CH_*
+	uint8_t flags;		// FT_STATUS_*
+	uint32_t flashTimeUs;
+	uint32_t flashLeftUs;	// of a running flash
+	uint8_t seqState;	// FT_SEQ_STATE_*
+	uint8_t seqIndex;
+	uint16_t seqRuns;
+	uint32_t deviceTime;	// when the status was taken, in timer ticks
+};
+
+/* one event of the device trace */
+struct TraceEntry
+{
+	uint8_t type;		// FT_TRACE_*
+	uint8_t arg;
+	uint32_t deviceTime;	// in timer ticks
+};
+
+/* allocations of libusb transfers by the host library, constant once the pool is filled */
+struct PoolStats
+{
+	uint64_t transferAllocs;	// libusb_alloc_transfer calls
+	uint64_t claims;			// of pool slots
+	uint64_t exhausted;			// transfers that found no free slot and went through the synchronous api
+};
+
+/* reads of lightState() and getFlashTime() served from the host side cache */
+struct CacheStats
+{
+	uint64_t hits;			// answered without a transfer
+	uint64_t misses;		// queried the controller
+	uint64_t invalidations;	// of a cached value by a command, an event or a reconnect
+};
+
+struct DeviceCounters
+{
+	uint16_t commands;	// processed, wraps
+	uint16_t flashRestarts;	// flashes started over a running one
+	uint16_t maxIsrLatencyTicks;	// of the timer interrupts
+};
+
+struct ClockCalibration
+{
+	double correctionPpm;	// applied to the tick and flash timer, positive if the crystal runs fast
+	double lastPpm;	// of the last measured window
+	uint16_t windows;	// of FT_CLOCK_WINDOW frames measured, 0 runs uncalibrated
+};
+
+struct ReconnectStatus
+{
+	bool connected;
+	int reconnects;			// since enableReconnect()
+	double lastRecoveryMs;	// from the departure to the replayed configuration
+};
+
+/* a configuration command as it was sent last, replayed after a reconnect */
+struct ReplayCommand
+{
+	int command;
+	int value;
+	int index;
+	vector<unsigned char> data;
+};
+
 class FlashTrig
 {
+public:
+	/* how the controller is reached, libusb, the hidraw node of the usb hid driver or its usbfs node.
+	 * Given a path or fd of the usbfs node, libusb skips the scan of the bus. */
+	enum Backend { LIBUSB, HIDRAW, USBFS };
+	/* why the last operation failed, for the decision whether and when to retry */
+	enum Error { ERR_NONE, ERR_TIMEOUT, ERR_STALL, ERR_DISCONNECTED, ERR_OVERFLOW, ERR_CANCELLED, ERR_FAILED, ERR_BUSY };
+	/* completion of a posted command, the reply of a query */
+	struct Result
+	{
+		Error error;
+		vector<unsigned char> reply;
+	};
+
 private:
-	libusb_device_handle *handle;
+	Backend backend = LIBUSB;
+	int devFd = -1;		// hidraw or usbfs node, closed with the object
+	void openHidraw(int fd);
+	void openUsbfs(int fd);
+	void wrapLibusb(int fd);
+	usbdevfs_urb *eventUrb = NULL;	// allocated once, interrupt transfers of the usbfs backend
+	usbdevfs_urb *outUrb = NULL;
+	bool usbfsSubmit(usbdevfs_urb *urb, int timeoutMs);
+	int usbfsControl(int requestType, int command, int usbValue, int usbIndex, unsigned char *data, int length, int timeoutMs);
+	bool hidSend(int command, int usbValue, int usbIndex, unsigned char *data, int length, bool feature);
+	void hidQuery(int command, int count, unsigned char *reply);
+	libusb_device_handle *handle = NULL;
 	libusb_context *context = NULL;
-	int usbTimeout = 5000;
-	int usbCount = 128;
-	void queryDevice(int command, int count);
+	int usbTimeout = 1000;			// transfers with data and queries
+	int commandTimeoutMs = 50;		// commands without data, the triggers
+	chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+	int timeoutFor(bool command);
+	static Error errorOf(int libusbError);
+	static Error errorOfStatus(int transferStatus);
+	static Error errorOfErrno(int err);
+	static const int poolSize = 8;
+	static const int poolGraceMs = 100;	// past the timeout of a pooled transfer before it is cancelled
+	struct PoolSlot
+	{
+		libusb_transfer *transfer = NULL;
+		unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 256];	// setup and up to usbCount bytes
+		atomic<bool> busy{false};
+		int completed = 1;
+	};
+	PoolSlot pool[poolSize];		// control transfers, allocated with the claim of the interface
+	atomic<uint64_t> transferAllocs{0};
+	atomic<uint64_t> poolClaims{0};
+	atomic<uint64_t> poolExhausted{0};
+	libusb_transfer *allocTransfer();
+	void fillPool();
+	PoolSlot *claimSlot(int requestType, int command, int usbValue, int usbIndex, int length);
+	int pooledControl(int requestType, int command, int usbValue, int usbIndex, unsigned char *data, int length, int timeoutMs);
+	PoolSlot *asyncSlot = NULL;		// the command of fireAsync()
+	bool startAsync(int command, int usbValue, int usbIndex);
+	static const int queueSize = 64;		// power of 2
+	static const int queueData = 64;		// data stage of a posted command
+	struct QueueSlot
+	{
+		atomic<size_t> sequence;
+		int command, value, index, length, count;	// count > 0 for a query
+		unsigned char data[queueData];
+		promise<Result> result;
+	};
+	QueueSlot queue[queueSize];
+	atomic<size_t> enqueuePos{0};
+	size_t dequeuePos = 0;			// only the submitter takes
+	enum SubmitterState { SUBMITTER_IDLE, SUBMITTER_STARTING, SUBMITTER_RUNNING, SUBMITTER_STOPPING };
+	atomic<int> submitterState{SUBMITTER_IDLE};	// enqueue() only takes while running
+	atomic<int> producers{0};		// in enqueue(), the stop waits for them
+	thread submitter;
+	int submitterWake = -1;			// eventfd, written only while the submitter sleeps
+	atomic<bool> submitterSleeping{false};
+	atomic<bool> submitterStop{false};	// all claimed slots are published, the rest is cancelled
+	future<Result> enqueue(int command, int usbValue, int usbIndex, const unsigned char *data, int length, int count);
+	void submitLoop();
+	void stopSubmitter();
+	int usbCount = 256;
+	struct CommandSpec
+	{
+		uint8_t requestType;	// FT_REQ_OUT or FT_REQ_IN, 0 for an unknown code
+		uint8_t value;			// FT_VAL_*
+		uint16_t length;		// data stage or reply, FT_LEN_VAR
+	};
+	static constexpr CommandSpec commandSpec(int command);
+	static constexpr int valueOf(int command, uint32_t value);
+	static constexpr int indexOf(int command, uint32_t value);
+	template<int Command> bool send(uint32_t value = 0, unsigned char *data = NULL, int length = commandSpec(Command).length);
+	template<int Command> using Reply = array<unsigned char, commandSpec(Command).length>;
+	template<int Command> Reply<Command> query();
+	void queryDevice(int command, int count, unsigned char *reply);
 	bool sendToDevice(int command);
 	bool sendToDevice(int command, int usbValue);
-	unsigned char rxBuffer[2];
+	bool sendToDevice(int command, int usbValue, int usbIndex);
+	bool sendToDevice(int command, int usbValue, int usbIndex, unsigned char *data, int length);
+	void claim(bool quiet = false);
+	vector<ClockSample> clockSamples;
+	uint64_t clockRefTicks = 0;		// last unwrapped device time
+	double clockOffsetUs = 0;		// host time at device time 0
+	double clockUsPerTick = 1000.0 / FT_TIMER_TICKS_PER_MS;
+	uint64_t unwrapDeviceTime(uint32_t deviceTs);
+	static ExtEvent decodeEvent(const unsigned char *report);
+	double lagCompensationUs = 0;	// scheduled shots are fired this much earlier
+	libusb_transfer *outTransfer = NULL;	// allocated once, commands without data go to the interrupt out endpoint
+	unsigned char outBuffer[FT_OUT_SIZE];
+	int outCompleted = 0;
+	static void LIBUSB_CALL transferCallback(libusb_transfer *transfer);
+	bool sendOut(int command, int usbValue, int usbIndex, int timeoutMs);
+	map<int, ReplayCommand> replay;	// by setting, see remember()
+	void remember(int command, int usbValue, int usbIndex, unsigned char *data, int length);
+	bool lightKnown = false;		// the cache, under deviceLock
+	bool lightTimed = false;		// the controller may switch the light later
+	bool lightOn = false;
+	bool flashTimeKnown = false;
+	uint32_t knownFlashTimeUs = 0;
+	atomic<uint64_t> cacheHits{0};
+	atomic<uint64_t> cacheMisses{0};
+	atomic<uint64_t> cacheInvalidations{0};
+	void updateCache(int command, int usbValue, int usbIndex, bool sent);
+	void forgetLight();
+	void forgetFlashTime();
+	bool extTriggerArmed();
+	recursive_mutex deviceLock;		// held by every transfer and by the reopen
+	atomic<bool> connected{true};
+	atomic<libusb_device *> currentDevice{NULL};
+	thread eventThread;				// handles libusb events and reopens the device
+	atomic<bool> eventStop{false};
+	libusb_hotplug_callback_handle hotplugHandle;
+	bool hotplugRegistered = false;
+	libusb_device *arrived = NULL;	// under connectLock, the callback runs on any event handling thread
+	int reopenTries = 0;
+	static const int reopenAttempts = 10;	// one per round of the event thread
+	bool rearm = false;				// replay arming and light, see enableReconnect()
+	bool replaying = false;			// under deviceLock, the reopen sends before connected is set
+	uint8_t busNumber = 0;
+	vector<uint8_t> portPath;
+	chrono::steady_clock::time_point leftAt;	// under connectLock
+	mutex connectLock;
+	condition_variable connectedCond;
+	ReconnectStatus reconnectState = { true, 0, 0 };
+	static int LIBUSB_CALL hotplugCallback(libusb_context *context, libusb_device *device,
+		libusb_hotplug_event event, void *user);
+	bool samePort(libusb_device *device);
+	void eventLoop();
+	bool reopen(libusb_device *device);
 
 public:
 	FlashTrig();
+	explicit FlashTrig(int deviceIndex);
+	FlashTrig(Backend backend, const char *path);
+	FlashTrig(Backend backend, int fd);
+	int hidrawFd();
+	static string devicePath(Backend backend, int deviceIndex);
+	static int brokerFd(Backend backend, int deviceIndex, const char *socketPath = FT_BROKER_SOCKET);
 	void setLight(bool on);
 	void trigger();
 	void flashAndTrigger();
-	uint16_t getFlashTime();
+	uint16_t getFlashTime(bool forceRefresh = false);
 	void setFlashTime(uint16_t flashTime);
-	bool lightState();
+	uint32_t getFlashTimeUs(bool forceRefresh = false);
+	void setFlashTimeUs(uint32_t flashTimeUs);
+	bool lightState(bool forceRefresh = false);
+	void invalidateCache();
+	CacheStats cacheStats();
+	void channelsOn(uint8_t mask);
+	void channelsOff(uint8_t mask);
+	void channelsPulse(uint8_t mask);
+	void setChannelTime(int channel, uint16_t ms);
+	uint16_t getChannelTime(int channel);
+	uint8_t channelState();
+	DeviceStatus status();
+	vector<TraceEntry> readTrace();
+	void resetTrace();
+	DeviceCounters counters();
+	ClockCalibration clockCalibration();
+	bool useOutEndpoint(bool on);
+	void setTimeouts(int commandMs, int transferMs);
+	void setDeadline(chrono::steady_clock::time_point until);
+	void clearDeadline();
+	static const char *errorName(Error error);
+	PoolStats poolStats();
+	bool fireAsync();
+	bool cancelAsync();
+	Error waitAsync(int timeoutMs);
+	bool startSubmitter();
+	future<Result> post(int command, int usbValue, int usbIndex, const unsigned char *data = NULL, int length = 0);
+	future<Result> postQuery(int command, int count);
+	template<int Command> future<Result> post(uint32_t value = 0, const unsigned char *data = NULL,
+		int length = commandSpec(Command).length);
+	template<int Command> future<Result> postQuery();
+	bool enableReconnect(bool rearm = false);
+	bool waitConnected(int timeoutMs);
+	ReconnectStatus reconnectStatus();
+	bool arm(uint32_t flashTimeUs, uint16_t leadMs, uint8_t pulseMs, uint8_t channels);
+	void fire();
+	void prefocus(uint16_t holdMs);
+	void prefocusAndFire(uint16_t delayMs);
+	void fireAtFrame(uint16_t frame);
+	FrameStatus frameStatus();
+	bool framesCounted();
+	static bool fireSynchronized(const vector<FlashTrig *> &devices, uint16_t leadFrames, double *spreadUs,
+		double *boundUs = NULL);
+	bool uploadSequence(const vector<SeqEvent> &events);
+	void startSequence(uint16_t runs);
+	void abortSequence();
+	SeqStatus sequenceStatus();
+	bool extTriggerArm(uint8_t flags, uint16_t debounceMs);
+	void extTriggerDisarm();
+	ExtStatus extTriggerStatus();
+	bool readEvent(ExtEvent *event, int timeoutMs);
+	bool setupShutterLag(bool enable, bool rising);
+	ShutterLag shutterLag();
+	bool compensateShutterLag(bool on);
+	bool setStrobe(double frequencyHz, double duty, uint16_t pulses);
+	void startStrobe(bool withTrigger, uint16_t delayMs);
+	void stopStrobe();
+	void setLightLead(uint16_t leadMs, uint16_t tailMs);
+	bool getLightLead(uint16_t *leadMs, uint16_t *tailMs);
+	bool calibrateLightLead(double riseMs, double exposureMs);
+	uint32_t deviceTime();
+	uint32_t lastCommandTime();
+	bool syncClock(int samples);
+	chrono::steady_clock::time_point toHostTime(uint32_t deviceTs);
 	~FlashTrig();
-	bool isOkay;
+	bool isOkay;	// of the last call, written under deviceLock, post() callers use their Result
+	Error lastError = ERR_NONE;	// of the last command or query, ERR_NONE while isOkay
 	
 };
 
+/* direction, value encoding and length of a command code, from FT_PROTOCOL in defines.h */
+#define FT_COMMAND_SPEC(command, type, value, length) code == (command) ? CommandSpec{ type, value, length } :
+constexpr FlashTrig::CommandSpec FlashTrig::commandSpec(int code) {
+	return FT_PROTOCOL(FT_COMMAND_SPEC) CommandSpec{ 0, FT_VAL_NONE, 0 };
+}
+
+/*
+ * A command to the controller, its value split over wValue and wIndex as
+ * the protocol table says. The checks fail at compile time, a query sent
+ * as command or a typo in the code does not get to the device.
+ */
+// wValue and wIndex of a value of command, split as the protocol table says
+constexpr int FlashTrig::valueOf(int command, uint32_t value) {
+	return commandSpec(command).value == FT_VAL_NONE ? 0 : (int)(value & 0xFFFF);
+}
+
+constexpr int FlashTrig::indexOf(int command, uint32_t value) {
+	return commandSpec(command).value == FT_VAL_32 ? (int)(value >> 16) : 0;
+}
+
+template<int Command>
+bool FlashTrig::send(uint32_t value, unsigned char *data, int length) {
+
+	static_assert(commandSpec(Command).requestType == FT_REQ_OUT, "not a command to the controller");
+
+	return this->sendToDevice(Command, valueOf(Command, value), indexOf(Command, value), data, length);
+}
+
+// the reply of the length in the protocol table, by value, so that no thread reads the reply of another
+template<int Command>
+FlashTrig::Reply<Command> FlashTrig::query() {
+
+	static_assert(commandSpec(Command).requestType == FT_REQ_IN, "not a query of the controller");
+
+	Reply<Command> reply = {};
+	this->queryDevice(Command, reply.size(), reply.data());
+	return reply;
+}
+
+// send<>() through the submitter
+template<int Command>
+future<FlashTrig::Result> FlashTrig::post(uint32_t value, const unsigned char *data, int length) {
+
+	static_assert(commandSpec(Command).requestType == FT_REQ_OUT, "not a command to the controller");
+
+	return this->enqueue(Command, valueOf(Command, value), indexOf(Command, value), data, length, 0);
+}
+
+// query<>() through the submitter, the reply of the future holds the table length
+template<int Command>
+future<FlashTrig::Result> FlashTrig::postQuery() {
+
+	static_assert(commandSpec(Command).requestType == FT_REQ_IN, "not a query of the controller");
+
+	return this->enqueue(Command, 0, 0, NULL, 0, commandSpec(Command).length);
+}
+
 FlashTrig::FlashTrig() {
 
-	libusb_device **devs = NULL;
 	int ret;
 
 
@@ -40,154 +455,2316 @@ FlashTrig::FlashTrig() {
 		this->isOkay = false;
 		return;
 	}
-	
-	size_t list;
-	list = libusb_get_device_list(this->context, &devs);
 
-	if (list < 0)
+	// scans the devices itself
+	this->handle = libusb_open_device_with_vid_pid(this->context, DEV_VENDOR_CLASS, DEV_PRODUCT_ID);
+
+	if (this->handle == NULL)
 	{
-		cerr << "Error in getting device list" << endl;
-		libusb_free_device_list(devs, 1);
-		libusb_exit(this->context);
+		cerr << "Could not find flashtrig device" << endl;
 		this->isOkay = false;
-		exit(1);
+		return;
 	}
 
+	this->claim();
+}
 
-	this->handle = libusb_open_device_with_vid_pid(this->context, DEV_VENDOR_CLASS, DEV_PRODUCT_ID);
+// opens the deviceIndex-th flashtrig controller, for rigs with several of them
+FlashTrig::FlashTrig(int deviceIndex) {
 
-	if (this->handle == NULL)
+	libusb_device **devs = NULL;
+	libusb_device_descriptor desc;
+	ssize_t count;
+	int ret;
+
+	ret = libusb_init(&(this->context));
+	if (ret < 0)
 	{
-		cerr << "Could not find flashtrig device" << endl;
+		cerr << "libusb_init failed" << endl;
 		this->isOkay = false;
 		return;
 	}
 
-	libusb_free_device_list(devs, 1);
-
-	// find out if kernel driver is attached
-	if (libusb_kernel_driver_active(this->handle, 0) == 1)
+	count = libusb_get_device_list(this->context, &devs);
+	for (ssize_t i = 0; i < count && this->handle == NULL; i++)
 	{
-		cout << "Kernel driver is active" << endl;
-		if (libusb_detach_kernel_driver(this->handle, 0) == 0)
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0
+			|| desc.idVendor != DEV_VENDOR_CLASS || desc.idProduct != DEV_PRODUCT_ID)
 		{
-			cout << "Kernel driver detached" << endl;
-		} else {
-			cout << "Error detaching kernel driver" << endl;
+			continue;
+		}
+		if (deviceIndex-- == 0 && libusb_open(devs[i], &(this->handle)) < 0)
+		{
+			this->handle = NULL;
+			break;
 		}
 	}
+	if (count >= 0)
+	{
+		libusb_free_device_list(devs, 1);
+	}
 
-	ret = libusb_claim_interface(this->handle, 0); // claim interface 0 of device
-	if (ret < 0)
+	if (this->handle == NULL)
 	{
-		cerr <<  "could not claim flashtrig interface" << endl;
+		cerr << "Could not find flashtrig device" << endl;
 		this->isOkay = false;
 		return;
 	}
-	this->isOkay = true;
 
+	this->claim();
 }
 
+// opens the controller through its hidraw node, e.g. /dev/hidraw0, without libusb
+FlashTrig::FlashTrig(Backend backend, const char *path) {
 
+	int fd;
 
-
-bool FlashTrig::lightState() {
-	this->queryDevice(FT_CMD_LIGHT_STATE, 1);
-	if (this->rxBuffer[0] == 0x01) {
-		return true;
+	this->isOkay = false;
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	{
+		cerr << "Could not open " << path << endl;
+		return;
+	}
+	if (backend == USBFS) {
+		this->openUsbfs(fd);
+	} else if (backend == HIDRAW) {
+		this->openHidraw(fd);
+	} else {
+		this->wrapLibusb(fd);
 	}
-	return false;
 }
 
-void FlashTrig::setFlashTime(uint16_t flashTime) {
+// takes over an open fd of the node and closes it when destroyed, -1 from a refused brokerFd() fails
+FlashTrig::FlashTrig(Backend backend, int fd) {
 
-	this->sendToDevice(FT_CMD_FLASH_TIME_SET, flashTime);
-	return;
+	this->isOkay = false;
+	if (fd < 0) {
+		return;
+	}
+	if (backend == USBFS) {
+		this->openUsbfs(fd);
+	} else if (backend == HIDRAW) {
+		this->openHidraw(fd);
+	} else {
+		this->wrapLibusb(fd);
+	}
 }
 
-void FlashTrig::trigger() {
+/*
+ * Hands the usbfs node, e.g. /dev/bus/usb/001/004, to libusb without any
+ * scan of the bus. The context is created without device discovery, which
+ * libusb before 1.0.27 only knows as a process wide option.
+ */
+void FlashTrig::wrapLibusb(int fd) {
 
-	this->sendToDevice(FT_CMD_TRIGGER);
-	return;
+	int ret;
+	libusb_device_descriptor desc;
+
+	this->devFd = fd;
+
+#if LIBUSB_API_VERSION >= 0x0100010A
+	libusb_init_option option = {};
+	option.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY;
+	ret = libusb_init_context(&(this->context), &option, 1);
+#elif LIBUSB_API_VERSION >= 0x01000107
+	libusb_set_option(NULL, LIBUSB_OPTION_NO_DEVICE_DISCOVERY);
+	ret = libusb_init(&(this->context));
+#else
+	ret = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+	if (ret < 0)
+	{
+		cerr << "libusb_init failed" << endl;
+		return;
+	}
+
+#if LIBUSB_API_VERSION >= 0x01000107
+	ret = libusb_wrap_sys_device(this->context, (intptr_t)fd, &(this->handle));
+#endif
+	if (ret < 0)
+	{
+		this->handle = NULL;
+		cerr << "Could not wrap the device node" << endl;
+		return;
+	}
+	if (libusb_get_device_descriptor(libusb_get_device(this->handle), &desc) < 0
+		|| desc.idVendor != DEV_VENDOR_CLASS || desc.idProduct != DEV_PRODUCT_ID)
+	{
+		cerr << "Not a flashtrig device" << endl;
+		return;
+	}
+
+	this->claim();
 }
 
-void FlashTrig::setLight(bool on) {
+void FlashTrig::openHidraw(int fd) {
 
-	if (on)	{
-		this->sendToDevice(FT_CMD_LIGHT_ON);
-	} else {
-		this->sendToDevice(FT_CMD_LIGHT_OFF);
+	hidraw_devinfo info;
+
+	this->backend = HIDRAW;
+	this->devFd = fd;
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0
+		|| (uint16_t)info.vendor != DEV_VENDOR_CLASS || (uint16_t)info.product != DEV_PRODUCT_ID)
+	{
+		cerr << "Not a flashtrig hidraw device" << endl;
+		return;
 	}
-	return;
+	this->isOkay = true;
 }
 
-void FlashTrig::flashAndTrigger() {
+// the fd of the hidraw backend, readable when an event report arrived, -1 otherwise
+int FlashTrig::hidrawFd() {
 
-	this->sendToDevice(FT_CMD_FLASH_AND_TRIGGER);
-	return;
+	return this->backend == HIDRAW ? this->devFd : -1;
 }
 
-uint16_t FlashTrig::getFlashTime() {
+/*
+ * The node of the deviceIndex-th controller from sysfs, without opening any
+ * device: the hidraw node for HIDRAW, the usbfs node otherwise. Empty if
+ * there is none.
+ */
+string FlashTrig::devicePath(Backend backend, int deviceIndex) {
 
-	this->queryDevice(FT_CMD_FLASH_TIME_GET, 2);
+	const char *base = backend == HIDRAW ? "/sys/class/hidraw" : "/sys/bus/usb/devices";
+	vector<string> names;
+	DIR *dir;
+	dirent *entry;
 
-	if (this->isOkay){
-		return (uint16_t)((this->rxBuffer[0] << 8) + this->rxBuffer[1]);
+	dir = opendir(base);
+	if (dir == NULL) {
+		return "";
 	}
-	return -1;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] != '.') {
+			names.push_back(entry->d_name);
+		}
+	}
+	closedir(dir);
+	sort(names.begin(), names.end());
+
+	for (const string &name : names) {
+		string dev = string(base) + "/" + name;
+		unsigned int bus, vendor, product, device;
+
+		if (backend == HIDRAW) {
+			// HID_ID=0003:000016C0:000005DC, the bus type and both ids
+			ifstream uevent(dev + "/device/uevent");
+			string line;
+			bool found = false;
+			while (getline(uevent, line)) {
+				if (sscanf(line.c_str(), "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3
+					&& vendor == DEV_VENDOR_CLASS && product == DEV_PRODUCT_ID) {
+					found = true;
+				}
+			}
+			if (found && deviceIndex-- == 0) {
+				return "/dev/" + name;
+			}
+			continue;
+		}
+
+		// interfaces have no ids and are skipped
+		ifstream vendorFile(dev + "/idVendor"), productFile(dev + "/idProduct");
+		ifstream busFile(dev + "/busnum"), deviceFile(dev + "/devnum");
+		if (!(vendorFile >> hex >> vendor) || !(productFile >> hex >> product)
+			|| vendor != DEV_VENDOR_CLASS || product != DEV_PRODUCT_ID
+			|| !(busFile >> bus) || !(deviceFile >> device)) {
+			continue;
+		}
+		if (deviceIndex-- == 0) {
+			char path[32];
+			snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", bus, device);
+			return path;
+		}
+	}
+	return "";
 }
 
-FlashTrig::~FlashTrig() {
+/*
+ * Asks flashtrig-broker for an open node of the deviceIndex-th controller,
+ * the hidraw node for HIDRAW, the usbfs node otherwise. The fd is passed to
+ * the FlashTrig constructors of the backend, -1 if the broker refused.
+ */
+int FlashTrig::brokerFd(Backend backend, int deviceIndex, const char *socketPath) {
+
+	sockaddr_un addr = {};
+	unsigned char request[2] = { (unsigned char)backend, (unsigned char)deviceIndex };
+	unsigned char reply = 0;
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	iovec iov = { &reply, 1 };
+	msghdr msg = {};
+	cmsghdr *cmsg;
+	int sock, fd = -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+	if (connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0
+		|| write(sock, request, sizeof(request)) != sizeof(request)) {
+		cerr << "Could not reach the broker at " << socketPath << endl;
+		close(sock);
+		return -1;
+	}
 
-	libusb_release_interface(this->handle, 0);
-	libusb_exit(this->context);
+	// one reply byte, an errno of the broker, and the fd on success
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == 1) {
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	close(sock);
+	if (reply != 0 && fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		cerr << "The broker refused: " << strerror(reply) << endl;
+	}
+	return fd;
 }
 
+/*
+ * Opens the controller through its usbfs node, /dev/bus/usb/BBB/DDD, and
+ * talks to it with plain ioctls: one per control transfer, and for the
+ * interrupt endpoints urbs that are allocated only once.
+ */
+void FlashTrig::openUsbfs(int fd) {
 
-bool FlashTrig::sendToDevice(int command, int usbValue) {
+	unsigned char desc[18];
+	usbdevfs_disconnect_claim claim = {};
 
-	int requestType, sentBytes;
-	static int usbDirection, usbType, usbRecipient, usbRequest, usbIndex; /* arguments of control transfer */
+	this->backend = USBFS;
+	this->devFd = fd;
 
-	usbDirection = 0; 	// [out* in]
-	usbType = 2; 		// [standard class vendor* reserved]
-	usbRecipient = 0; 	// [device* interface endpoint other]
-	usbRequest = command;
-	usbIndex = 1; 
-	requestType = ((usbDirection & 1) << 7) | ((usbType & 3) << 5) | (usbRecipient & 0x1f); // USB standard § 9.3
-	
-	sentBytes = libusb_control_transfer(this->handle, requestType, usbRequest, usbValue, usbIndex, NULL, 0, usbTimeout);
-	if (sentBytes == 0)
+	// the node reads as the raw descriptors, the device descriptor first
+	if (pread(fd, desc, sizeof(desc), 0) != sizeof(desc)
+		|| desc[8] + (desc[9] << 8) != DEV_VENDOR_CLASS || desc[10] + (desc[11] << 8) != DEV_PRODUCT_ID)
 	{
-		this->isOkay = true;
-		return true;
+		cerr << "Not a flashtrig usbfs device" << endl;
+		return;
 	}
-	this->isOkay = false;
-	return false;
+
+	// like claim(), a bound kernel driver is detached
+	claim.interface = 0;
+	if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &claim) < 0)
+	{
+		cerr <<  "could not claim flashtrig interface" << endl;
+		return;
+	}
+
+	this->eventUrb = (usbdevfs_urb *)calloc(1, sizeof(usbdevfs_urb));
+	if (this->eventUrb == NULL) {
+		return;
+	}
+	this->eventUrb->type = USBDEVFS_URB_TYPE_INTERRUPT;
+	this->eventUrb->endpoint = FT_EVENT_ENDPOINT;
+	this->eventUrb->buffer_length = FT_EVENT_SIZE;
+	this->isOkay = true;
 }
 
-bool FlashTrig::sendToDevice(int command) {
-	return this->sendToDevice(command, 1);
+/*
+ * Submits an interrupt urb and reaps it within timeoutMs. On a timeout the
+ * urb is discarded, its status is then -ENOENT, unless it completed meanwhile.
+ */
+bool FlashTrig::usbfsSubmit(usbdevfs_urb *urb, int timeoutMs) {
+
+	usbdevfs_urb *reaped = NULL;
+	pollfd pfd = { this->devFd, POLLOUT, 0 };
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	int ret, left;
+
+	if (ioctl(this->devFd, USBDEVFS_SUBMITURB, urb) < 0) {
+		urb->status = -errno;
+		return false;
+	}
+	// only this urb is in flight, whatever is reaped is it
+	while (ioctl(this->devFd, USBDEVFS_REAPURBNDELAY, &reaped) < 0) {
+		if (errno != EAGAIN) {
+			urb->status = -errno;
+			return false;
+		}
+		left = (int)chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+		ret = poll(&pfd, 1, max(left, 0));
+		if (ret == 0 || (ret < 0 && errno != EINTR)) {
+			ioctl(this->devFd, USBDEVFS_DISCARDURB, urb);
+			while (ioctl(this->devFd, USBDEVFS_REAPURB, &reaped) < 0 && errno == EINTR) {
+			}
+			break;
+		}
+	}
+	return urb->status == 0;
 }
 
-void FlashTrig::queryDevice(int command, int count) {
+// a control transfer on endpoint 0, returns the bytes transferred or -1
+int FlashTrig::usbfsControl(int requestType, int command, int usbValue, int usbIndex, unsigned char *data, int length, int timeoutMs) {
+
+	usbdevfs_ctrltransfer ctrl;
 
-	int requestType, recBytes;
-	static int usbDirection, usbType, usbRecipient, usbRequest, usbValue, usbIndex; /* arguments of control transfer */
+	ctrl.bRequestType = (uint8_t)requestType;
+	ctrl.bRequest = (uint8_t)command;
+	ctrl.wValue = (uint16_t)usbValue;
+	ctrl.wIndex = (uint16_t)usbIndex;
+	ctrl.wLength = (uint16_t)length;
+	ctrl.timeout = timeoutMs;
+	ctrl.data = data;
+	return ioctl(this->devFd, USBDEVFS_CONTROL, &ctrl);
+}
 
-	usbDirection = 1; 	// [out in*]
-	usbType = 2; 		// [standard class vendor* reserved]
-	usbRecipient = 0;	// [device* interface endpoint other]
-	usbRequest = command;
-	usbValue = 1;
-	usbIndex = 1;
-	requestType = ((usbDirection & 1) << 7) | ((usbType & 3) << 5) | (usbRecipient & 0x1f); // USB standard § 9.3
+// quiet for the reopen on the event thread, which must not write to the console of the application
+void FlashTrig::claim(bool quiet) {
 
-	recBytes = libusb_control_transfer(this->handle, requestType, usbRequest, usbValue, usbIndex, this->rxBuffer, usbCount, usbTimeout);
-	if (recBytes != count) {
+	int ret;
+
+	// find out if kernel driver is attached
+	if (libusb_kernel_driver_active(this->handle, 0) == 1)
+	{
+		ret = libusb_detach_kernel_driver(this->handle, 0);
+		if (!quiet) {
+			cout << "Kernel driver is active" << endl;
+			cout << (ret == 0 ? "Kernel driver detached" : "Error detaching kernel driver") << endl;
+		}
+	}
+
+	ret = libusb_claim_interface(this->handle, 0); // claim interface 0 of device
+	if (ret < 0)
+	{
+		if (!quiet) {
+			cerr <<  "could not claim flashtrig interface" << endl;
+		}
 		this->isOkay = false;
 		return;
-	} 
+	}
+	this->fillPool();
 	this->isOkay = true;
+
+}
+
+
+
+
+/*
+ * Fetches all state of the controller in one transfer. Later firmware only
+ * appends fields, the request asks for the FT_STATUS_SIZE known here.
+ */
+DeviceStatus FlashTrig::status() {
+
+	DeviceStatus status = {};
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+
+	auto reply = this->query<FT_CMD_STATUS>();
+
+	if (this->isOkay && (reply[0] < 1 || reply[1] < FT_STATUS_SIZE)) {
+		this->isOkay = false;
+	}
+	if (this->isOkay){
+		status.version = reply[0];
+		status.channels = reply[2];
+		status.flags = reply[3];
+		status.flashTimeUs = ((uint32_t)reply[4] << 24) + ((uint32_t)reply[5] << 16)
+			+ ((uint32_t)reply[6] << 8) + reply[7];
+		status.flashLeftUs = ((uint32_t)reply[8] << 24) + ((uint32_t)reply[9] << 16)
+			+ ((uint32_t)reply[10] << 8) + reply[11];
+		status.seqState = reply[12];
+		status.seqIndex = reply[13];
+		status.seqRuns = (uint16_t)((reply[14] << 8) + reply[15]);
+		status.deviceTime = ((uint32_t)reply[16] << 24) + ((uint32_t)reply[17] << 16)
+			+ ((uint32_t)reply[18] << 8) + reply[19];
+
+		this->knownFlashTimeUs = status.flashTimeUs;
+		this->flashTimeKnown = true;
+		// the light only stays as read if nothing on the controller switches it later
+		this->lightOn = (status.channels & FT_CH_FLASH) != 0;
+		this->lightTimed = status.flashLeftUs != 0 || status.seqState == FT_SEQ_STATE_RUNNING
+			|| (status.flags & (FT_STATUS_STROBE | FT_STATUS_EXT_ARMED | FT_STATUS_FRAME_PENDING
+				| FT_STATUS_LEAD_PENDING | FT_STATUS_FOCUS_PENDING)) != 0;
+		this->lightKnown = !this->lightTimed;
+	}
+	return status;
+}
+
+/*
+ * Reads the trace of the device, oldest entry first. The device stops
+ * recording with the read, so that the ring stays consistent, until
+ * resetTrace() clears and restarts it.
+ */
+vector<TraceEntry> FlashTrig::readTrace() {
+
+	vector<TraceEntry> entries;
+
+	auto reply = this->query<FT_CMD_TRACE_GET>();
+	if (!this->isOkay) {
+		return entries;
+	}
+
+	int next = reply[0];
+	bool wrapped = reply[1] != 0;
+	int first = wrapped ? next : 0;
+	int count = wrapped ? FT_TRACE_ENTRIES : next;
+	for (int i = 0; i < count; i++) {
+		unsigned char *p = reply.data() + FT_TRACE_HEADER + ((first + i) % FT_TRACE_ENTRIES) * FT_TRACE_ENTRY_SIZE;
+		TraceEntry entry;
+		entry.type = p[0];
+		entry.arg = p[1];
+		entry.deviceTime = ((uint32_t)p[2] << 24) + ((uint32_t)p[3] << 16) + ((uint32_t)p[4] << 8) + p[5];
+		entries.push_back(entry);
+	}
+	return entries;
+}
+
+// clears trace and counters of the device and restarts recording
+void FlashTrig::resetTrace() {
+
+	this->send<FT_CMD_TRACE_RESET>();
 	return;
-}
\ No newline at end of file
+}
+
+DeviceCounters FlashTrig::counters() {
+
+	DeviceCounters counters = {};
+
+	auto reply = this->query<FT_CMD_COUNTERS_GET>();
+
+	if (this->isOkay){
+		counters.commands = (uint16_t)((reply[0] << 8) + reply[1]);
+		counters.flashRestarts = (uint16_t)((reply[2] << 8) + reply[3]);
+		counters.maxIsrLatencyTicks = (uint16_t)((reply[4] << 8) + reply[5]);
+	}
+	return counters;
+}
+
+// the correction of the device timer against the usb frames
+ClockCalibration FlashTrig::clockCalibration() {
+
+	ClockCalibration clock = {};
+
+	auto reply = this->query<FT_CMD_CLOCK_GET>();
+
+	if (this->isOkay){
+		int32_t correction = (int32_t)(((uint32_t)reply[0] << 24) + ((uint32_t)reply[1] << 16)
+			+ ((uint32_t)reply[2] << 8) + reply[3]);
+		int32_t last = (int32_t)(((uint32_t)reply[4] << 24) + ((uint32_t)reply[5] << 16)
+			+ ((uint32_t)reply[6] << 8) + reply[7]);
+
+		clock.correctionPpm = correction * 1e6 / FT_CLOCK_SCALE;
+		clock.lastPpm = last * 1e6 / FT_CLOCK_SCALE;
+		clock.windows = (uint16_t)((reply[8] << 8) + reply[9]);
+	}
+	return clock;
+}
+
+/*
+ * The light as last set or read, without a transfer. forceRefresh, or a
+ * light that may have been switched by the controller since, queries it.
+ */
+bool FlashTrig::lightState(bool forceRefresh) {
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+
+	if (!forceRefresh && this->lightKnown && this->connected && !this->extTriggerArmed()) {
+		this->cacheHits++;
+		this->lastError = ERR_NONE;
+		this->isOkay = true;
+		return this->lightOn;
+	}
+	this->cacheMisses++;
+	return (this->status().channels & FT_CH_FLASH) != 0;
+}
+
+void FlashTrig::setFlashTime(uint16_t flashTime) {
+
+	this->send<FT_CMD_FLASH_TIME_SET>(flashTime);
+	return;
+}
+
+void FlashTrig::setFlashTimeUs(uint32_t flashTimeUs) {
+
+	// the device takes the lower 16 bit from wValue and the upper ones from wIndex
+	this->send<FT_CMD_FLASH_TIME_US_SET>(flashTimeUs);
+	return;
+}
+
+void FlashTrig::trigger() {
+
+	this->send<FT_CMD_TRIGGER>();
+	return;
+}
+
+void FlashTrig::setLight(bool on) {
+
+	if (on)	{
+		this->send<FT_CMD_LIGHT_ON>();
+	} else {
+		this->send<FT_CMD_LIGHT_OFF>();
+	}
+	return;
+}
+
+void FlashTrig::flashAndTrigger() {
+
+	this->send<FT_CMD_FLASH_AND_TRIGGER>();
+	return;
+}
+
+uint16_t FlashTrig::getFlashTime(bool forceRefresh) {
+
+	uint32_t flashTimeUs = this->getFlashTimeUs(forceRefresh);
+
+	if (this->isOkay){
+		return (uint16_t)min(flashTimeUs / 1000, (uint32_t)0xFFFF);
+	}
+	return -1;
+}
+
+// the flash time as last set or read, only a reconnect or forceRefresh queries it again
+uint32_t FlashTrig::getFlashTimeUs(bool forceRefresh) {
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+
+	if (!forceRefresh && this->flashTimeKnown && this->connected) {
+		this->cacheHits++;
+		this->lastError = ERR_NONE;
+		this->isOkay = true;
+		return this->knownFlashTimeUs;
+	}
+	this->cacheMisses++;
+	DeviceStatus status = this->status();
+
+	if (this->isOkay){
+		return status.flashTimeUs;
+	}
+	return -1;
+}
+
+// switches the channels of mask (FT_CH_*) on, until they are switched off
+void FlashTrig::channelsOn(uint8_t mask) {
+
+	this->send<FT_CMD_CHANNEL_ON>(mask);
+	return;
+}
+
+void FlashTrig::channelsOff(uint8_t mask) {
+
+	this->send<FT_CMD_CHANNEL_OFF>(mask);
+	return;
+}
+
+// switches the channels of mask on, each one for its own time
+void FlashTrig::channelsPulse(uint8_t mask) {
+
+	this->send<FT_CMD_CHANNEL_PULSE>(mask);
+	return;
+}
+
+void FlashTrig::setChannelTime(int channel, uint16_t ms) {
+
+	this->send<FT_CMD_CHANNEL_TIME_SET>(ms | (uint32_t)channel << 16);
+	return;
+}
+
+uint16_t FlashTrig::getChannelTime(int channel) {
+
+	auto reply = this->query<FT_CMD_CHANNEL_GET>();
+
+	if (this->isOkay && channel >= 0 && channel < FT_CHANNELS){
+		return (uint16_t)((reply[1 + 2 * channel] << 8) + reply[2 + 2 * channel]);
+	}
+	return -1;
+}
+
+// the mask of the channels, that are currently on
+uint8_t FlashTrig::channelState() {
+
+	DeviceStatus status = this->status();
+
+	if (this->isOkay){
+		return status.channels;
+	}
+	return 0;
+}
+
+// preloads a shot on the device, that fire() executes with minimal latency
+bool FlashTrig::arm(uint32_t flashTimeUs, uint16_t leadMs, uint8_t pulseMs, uint8_t channels) {
+
+	unsigned char shot[FT_ARM_SIZE] = {
+		(unsigned char)(flashTimeUs >> 24), (unsigned char)(flashTimeUs >> 16),
+		(unsigned char)(flashTimeUs >> 8), (unsigned char)flashTimeUs,
+		(unsigned char)(leadMs >> 8), (unsigned char)leadMs,
+		pulseMs,
+		channels
+	};
+
+	return this->send<FT_CMD_ARM>(0, shot);
+}
+
+void FlashTrig::fire() {
+
+	this->send<FT_CMD_FIRE>();
+	return;
+}
+
+// half presses the camera remote for holdMs, 0 uses the time of the focus channel
+void FlashTrig::prefocus(uint16_t holdMs) {
+
+	this->send<FT_CMD_PREFOCUS>(holdMs);
+	return;
+}
+
+// half presses and fires the armed shot delayMs later, all timed by the device
+void FlashTrig::prefocusAndFire(uint16_t delayMs) {
+
+	this->send<FT_CMD_FOCUS_FIRE>(delayMs);
+	return;
+}
+
+// fires the armed shot at the start of the given usb frame of this device
+void FlashTrig::fireAtFrame(uint16_t frame) {
+
+	// with compensation the exposure, not the trigger, starts at the frame
+	frame -= (uint16_t)(this->lagCompensationUs / 1000 + 0.5);
+	this->send<FT_CMD_FRAME_FIRE>(frame);
+	return;
+}
+
+FrameStatus FlashTrig::frameStatus() {
+
+	FrameStatus status = {};
+
+	auto reply = this->query<FT_CMD_FRAME_GET>();
+
+	if (this->isOkay){
+		status.frame = (uint16_t)((reply[0] << 8) + reply[1]);
+		status.state = reply[2];
+		status.target = (uint16_t)((reply[3] << 8) + reply[4]);
+		status.fireTicks = (uint16_t)((reply[5] << 8) + reply[6]);
+	}
+	return status;
+}
+
+/*
+ * Whether the controller counts the usb frames. A low speed device only
+ * sees them on D-: on a stock board with INT0 on D+ the counter stands
+ * still, and frame synchronized firing is not supported.
+ */
+bool FlashTrig::framesCounted() {
+
+	uint16_t first = this->frameStatus().frame;
+	if (!this->isOkay) {
+		return false;
+	}
+	usleep(3000);
+	return this->frameStatus().frame != first && this->isOkay;
+}
+
+/*
+ * Fires the armed shots of all devices at the same usb frame, leadFrames from now.
+ * All controllers count the same frame starts, only their counters started at
+ * different times. The offset of each counter to the first device is taken
+ * from a read of the device between two reads of the first device, as if it
+ * happened at their midpoint, as the samples of syncClock(). The narrowest of
+ * these brackets wins, half its width bounds the error of the offset and is
+ * reported in boundUs. spreadUs is the difference of the delays from the frame
+ * start to the shot, as the devices report them, not a measured skew.
+ * Fails on controllers, that do not count the frames, see framesCounted().
+ */
+bool FlashTrig::fireSynchronized(const vector<FlashTrig *> &devices, uint16_t leadFrames, double *spreadUs, double *boundUs) {
+
+	const int attempts = 20;
+	vector<int16_t> offsets(devices.size(), 0);
+	FlashTrig *reference;
+	uint16_t before, after, target;
+	int bound = 0;
+
+	if (devices.empty()) {
+		return false;
+	}
+	reference = devices[0];
+
+	for (FlashTrig *device : devices) {
+		if (!device->framesCounted()) {
+			lock_guard<recursive_mutex> lock(device->deviceLock);
+			if (device->isOkay) {
+				device->lastError = ERR_FAILED;
+				device->isOkay = false;
+			}
+			return false;
+		}
+	}
+
+	for (size_t i = 1; i < devices.size(); i++) {
+		int best = -1;
+		for (int attempt = 0; attempt < attempts && best != 0; attempt++) {
+			before = reference->frameStatus().frame;
+			uint16_t frame = devices[i]->frameStatus().frame;
+			after = reference->frameStatus().frame;
+			if (!reference->isOkay || !devices[i]->isOkay) {
+				return false;
+			}
+			uint16_t width = after - before;
+			if (best < 0 || width < best) {
+				best = width;
+				offsets[i] = (int16_t)(frame - (uint16_t)(before + width / 2));
+			}
+		}
+		bound = max(bound, (best + 1) / 2);
+	}
+
+	target = reference->frameStatus().frame + leadFrames;
+	for (size_t i = 0; i < devices.size(); i++) {
+		devices[i]->fireAtFrame(target + offsets[i]);
+		if (!devices[i]->isOkay) {
+			return false;
+		}
+	}
+
+	// wait for the shot, a frame is 1ms long
+	usleep((leadFrames + 2) * 1000);
+
+	uint16_t earliest = 0, latest = 0;
+	for (size_t i = 0; i < devices.size(); i++) {
+		FrameStatus status = devices[i]->frameStatus();
+		if (!devices[i]->isOkay || status.state != FT_FRAME_FIRED) {
+			return false;
+		}
+		if (i == 0 || status.fireTicks < earliest) {
+			earliest = status.fireTicks;
+		}
+		if (i == 0 || status.fireTicks > latest) {
+			latest = status.fireTicks;
+		}
+	}
+	if (spreadUs != NULL) {
+		*spreadUs = (latest - earliest) * 1000.0 / FT_TIMER_TICKS_PER_MS;
+	}
+	if (boundUs != NULL) {
+		*boundUs = bound * 1000.0;
+	}
+	return true;
+}
+
+// the events must be sorted by their offset, the device plays them in order
+bool FlashTrig::uploadSequence(const vector<SeqEvent> &events) {
+
+	unsigned char table[FT_SEQ_MAX_EVENTS * FT_SEQ_EVENT_SIZE];
+	unsigned char *p = table;
+
+	// one slot is needed for the end marker
+	if (events.size() >= FT_SEQ_MAX_EVENTS) {
+		lock_guard<recursive_mutex> lock(this->deviceLock);
+		this->isOkay = false;
+		return false;
+	}
+
+	for (const SeqEvent &event : events) {
+		uint32_t offsetMs = event.offsetMs;
+		// move the trigger ahead of the wanted exposure, as far as the run allows
+		if (event.action == FT_SEQ_TRIGGER || event.action == FT_SEQ_FLASH_AND_TRIGGER) {
+			offsetMs -= min(offsetMs, (uint32_t)(this->lagCompensationUs / 1000 + 0.5));
+		}
+		*p++ = event.action;
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			*p++ = (unsigned char)(offsetMs >> shift);
+		}
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			*p++ = (unsigned char)(event.param >> shift);
+		}
+	}
+	// terminate the table after the last event, unless the caller did already
+	if (events.empty() || events.back().action != FT_SEQ_END) {
+		uint32_t end = events.empty() ? 0 : events.back().offsetMs;
+		*p++ = FT_SEQ_END;
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			*p++ = (unsigned char)(end >> shift);
+		}
+		for (int i = 0; i < 4; i++) {
+			*p++ = 0;
+		}
+	}
+
+	return this->send<FT_CMD_SEQ_UPLOAD>(0, table, p - table);
+}
+
+void FlashTrig::startSequence(uint16_t runs) {
+
+	this->send<FT_CMD_SEQ_START>(runs);
+	return;
+}
+
+void FlashTrig::abortSequence() {
+
+	this->send<FT_CMD_SEQ_ABORT>();
+	return;
+}
+
+SeqStatus FlashTrig::sequenceStatus() {
+
+	SeqStatus status = {};
+
+	auto reply = this->query<FT_CMD_SEQ_STATUS>();
+
+	if (this->isOkay){
+		status.state = reply[0];
+		status.index = reply[1];
+		status.runs = (uint16_t)((reply[2] << 8) + reply[3]);
+		status.elapsedMs = ((uint32_t)reply[4] << 24) + ((uint32_t)reply[5] << 16)
+			+ ((uint32_t)reply[6] << 8) + reply[7];
+	}
+	return status;
+}
+
+/*
+ * Arms the external trigger input, its edge fires the armed shot, or flash
+ * and trigger with the set times, on the device without any host round trip. flags is a mask of FT_EXT_*, further
+ * edges within debounceMs after an event are ignored.
+ */
+bool FlashTrig::extTriggerArm(uint8_t flags, uint16_t debounceMs) {
+
+	return this->send<FT_CMD_EXT_ARM>((flags | FT_EXT_ENABLE) | (uint32_t)debounceMs << 16);
+}
+
+void FlashTrig::extTriggerDisarm() {
+
+	this->send<FT_CMD_EXT_ARM>(0);
+	return;
+}
+
+ExtEvent FlashTrig::decodeEvent(const unsigned char *report) {
+
+	ExtEvent event = {};
+
+	event.count = report[1];
+	event.deviceTime = ((uint32_t)report[2] << 24) + ((uint32_t)report[3] << 16)
+		+ ((uint32_t)report[4] << 8) + report[5];
+	event.fireTicks = (uint16_t)((report[6] << 8) + report[7]);
+	event.fireUs = event.fireTicks * 1000.0 / FT_TIMER_TICKS_PER_MS;
+	return event;
+}
+
+ExtStatus FlashTrig::extTriggerStatus() {
+
+	ExtStatus status = {};
+
+	auto reply = this->query<FT_CMD_EXT_STATUS>();
+
+	if (this->isOkay){
+		status.flags = reply[0];
+		status.debounceMs = (uint16_t)((reply[1] << 8) + reply[2]);
+		status.last = decodeEvent(reply.data() + 3);
+	}
+	return status;
+}
+
+/*
+ * Waits up to timeoutMs for the next external trigger event on the interrupt
+ * endpoint. A timeout returns false, but leaves isOkay set. The latency of
+ * the host notification is received - toHostTime(deviceTime).
+ */
+bool FlashTrig::readEvent(ExtEvent *event, int timeoutMs) {
+
+	unsigned char report[FT_EVENT_SIZE];
+	int received, ret;
+
+	if (this->backend == HIDRAW) {
+		// the event report is the input report
+		pollfd pfd = { this->devFd, POLLIN, 0 };
+		ret = poll(&pfd, 1, timeoutMs);
+		if (ret == 0) {
+			lock_guard<recursive_mutex> lock(this->deviceLock);
+			this->isOkay = true;
+			return false;
+		}
+		received = ret < 0 ? -1 : read(this->devFd, report, FT_EVENT_SIZE);
+		ret = received < 0 ? -1 : 0;
+	} else if (this->backend == USBFS) {
+		this->eventUrb->buffer = report;
+		if (this->usbfsSubmit(this->eventUrb, timeoutMs)) {
+			ret = 0;
+		} else if (this->eventUrb->status == -ENOENT || this->eventUrb->status == -ECONNRESET) {
+			ret = LIBUSB_ERROR_TIMEOUT;
+		} else {
+			ret = -1;
+		}
+		received = this->eventUrb->actual_length;
+	} else {
+		ret = libusb_interrupt_transfer(this->handle, FT_EVENT_ENDPOINT, report, FT_EVENT_SIZE, &received, timeoutMs);
+	}
+
+	// the wait for the event is not under the lock, commands go on meanwhile
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+	if (ret == LIBUSB_ERROR_TIMEOUT) {
+		this->lastError = ERR_NONE;
+		this->isOkay = true;
+		return false;
+	}
+	if (ret < 0 || received != FT_EVENT_SIZE || report[0] != FT_EVENT_EXT_TRIGGER) {
+		this->lastError = ret < 0 && this->backend == LIBUSB ? errorOf(ret) : ERR_FAILED;
+		this->isOkay = false;
+		return false;
+	}
+	*event = decodeEvent(report);
+	event->received = chrono::steady_clock::now();
+	// the event fired the armed shot
+	this->forgetLight();
+	this->lastError = ERR_NONE;
+	this->isOkay = true;
+	return true;
+}
+
+/*
+ * Enables the measurement of the delay from the trigger edge to the flash
+ * sync of the camera, connected to the sync input of the controller. A hot
+ * shoe contact pulls the input low, other sources may rise instead.
+ */
+bool FlashTrig::setupShutterLag(bool enable, bool rising) {
+
+	uint8_t flags = (enable ? FT_LAG_ENABLE : 0) | (rising ? FT_LAG_RISING : 0);
+
+	return this->send<FT_CMD_LAG_SETUP>(flags);
+}
+
+// the distribution of the lags measured since the setup, at most of the last FT_LAG_SAMPLES shots
+ShutterLag FlashTrig::shutterLag() {
+
+	ShutterLag lag = {};
+	vector<double> samples;
+
+	auto reply = this->query<FT_CMD_LAG_GET>();
+	if (!this->isOkay) {
+		return lag;
+	}
+
+	// slots without a measurement yet are 0
+	for (int i = 0; i < FT_LAG_SAMPLES; i++) {
+		unsigned char *p = reply.data() + 1 + 4 * i;
+		uint32_t ticks = ((uint32_t)p[0] << 24) + ((uint32_t)p[1] << 16) + ((uint32_t)p[2] << 8) + p[3];
+		if (ticks != 0) {
+			samples.push_back(ticks * 1000.0 / FT_TIMER_TICKS_PER_MS);
+		}
+	}
+	if (samples.empty()) {
+		return lag;
+	}
+
+	sort(samples.begin(), samples.end());
+	lag.samples = samples.size();
+	lag.minUs = samples.front();
+	lag.medianUs = samples[samples.size() / 2];
+	lag.maxUs = samples.back();
+	for (double us : samples) {
+		lag.meanUs += us / samples.size();
+	}
+	return lag;
+}
+
+/*
+ * Fires scheduled shots, fireAtFrame() and the trigger events of uploaded
+ * sequences, earlier by the median of the measured shutter lag, so that the
+ * exposure starts at the scheduled time. Needs measured shots to turn on.
+ */
+bool FlashTrig::compensateShutterLag(bool on) {
+
+	this->lagCompensationUs = 0;
+	if (!on) {
+		return true;
+	}
+	ShutterLag lag = this->shutterLag();
+	if (!this->isOkay || lag.samples == 0) {
+		return false;
+	}
+	this->lagCompensationUs = lag.medianUs;
+	return true;
+}
+
+/*
+ * Sets the strobe: pulses of the light at frequencyHz, on for the duty part
+ * (0 to 1) of each period. The controller switches the light by the compare
+ * output of its timer, so the edges have no software jitter. Each phase is
+ * at least 200us, pulses of 0 runs until stopped.
+ */
+bool FlashTrig::setStrobe(double frequencyHz, double duty, uint16_t pulses) {
+
+	if (frequencyHz <= 0 || duty <= 0 || duty >= 1) {
+		lock_guard<recursive_mutex> lock(this->deviceLock);
+		this->isOkay = false;
+		return false;
+	}
+	uint32_t periodUs = (uint32_t)(1e6 / frequencyHz + 0.5);
+	uint32_t onUs = (uint32_t)(periodUs * duty + 0.5);
+
+	unsigned char strobe[FT_STROBE_SIZE] = {
+		(unsigned char)(periodUs >> 24), (unsigned char)(periodUs >> 16),
+		(unsigned char)(periodUs >> 8), (unsigned char)periodUs,
+		(unsigned char)(onUs >> 24), (unsigned char)(onUs >> 16),
+		(unsigned char)(onUs >> 8), (unsigned char)onUs,
+		(unsigned char)(pulses >> 8), (unsigned char)pulses
+	};
+
+	return this->send<FT_CMD_STROBE_SET>(0, strobe);
+}
+
+/*
+ * Runs the set strobe. withTrigger holds the trigger (e.g. bulb mode) from
+ * delayMs before the first pulse until the last pulse ended, as one
+ * operation of the controller.
+ */
+void FlashTrig::startStrobe(bool withTrigger, uint16_t delayMs) {
+
+	this->send<FT_CMD_STROBE_RUN>((FT_STROBE_RUN | (withTrigger ? FT_STROBE_WITH_TRIGGER : 0)) | (uint32_t)delayMs << 16);
+	return;
+}
+
+void FlashTrig::stopStrobe() {
+
+	this->send<FT_CMD_STROBE_RUN>(0);
+	return;
+}
+
+// switches the light on leadMs ahead of the trigger and keeps it on tailMs after it, 0 uses the flash time
+void FlashTrig::setLightLead(uint16_t leadMs, uint16_t tailMs) {
+
+	this->send<FT_CMD_LIGHT_LEAD_SET>(leadMs | (uint32_t)tailMs << 16);
+	return;
+}
+
+bool FlashTrig::getLightLead(uint16_t *leadMs, uint16_t *tailMs) {
+
+	auto reply = this->query<FT_CMD_LIGHT_LEAD_GET>();
+
+	if (this->isOkay){
+		*leadMs = (uint16_t)((reply[0] << 8) + reply[1]);
+		*tailMs = (uint16_t)((reply[2] << 8) + reply[3]);
+	}
+	return this->isOkay;
+}
+
+/*
+ * Picks lead and tail from the measured shutter lag, for a light that needs
+ * riseMs to reach full output. The light is at full output before the
+ * fastest measured shutter opens and stays on for exposureMs after the
+ * slowest one.
+ */
+bool FlashTrig::calibrateLightLead(double riseMs, double exposureMs) {
+
+	ShutterLag lag = this->shutterLag();
+	if (!this->isOkay || lag.samples == 0) {
+		return false;
+	}
+	double leadMs = ceil(max(0.0, riseMs - lag.minUs / 1000));
+	double tailMs = ceil(lag.maxUs / 1000 + exposureMs);
+	this->setLightLead((uint16_t)min(leadMs, 65535.0), (uint16_t)min(tailMs, 65535.0));
+	return this->isOkay;
+}
+
+// the current device time in timer ticks
+uint32_t FlashTrig::deviceTime() {
+
+	auto reply = this->query<FT_CMD_TIMESTAMP_GET>();
+
+	if (this->isOkay){
+		return ((uint32_t)reply[4] << 24) + ((uint32_t)reply[5] << 16)
+			+ ((uint32_t)reply[6] << 8) + reply[7];
+	}
+	return 0;
+}
+
+// the device time, at which the command before this query was processed
+uint32_t FlashTrig::lastCommandTime() {
+
+	auto reply = this->query<FT_CMD_TIMESTAMP_GET>();
+
+	if (this->isOkay){
+		return ((uint32_t)reply[0] << 24) + ((uint32_t)reply[1] << 16)
+			+ ((uint32_t)reply[2] << 8) + reply[3];
+	}
+	return 0;
+}
+
+// extends a 32 bit device time to 64 bit around the last known device time
+uint64_t FlashTrig::unwrapDeviceTime(uint32_t deviceTs) {
+
+	if (this->clockSamples.empty()) {
+		return deviceTs;
+	}
+	int32_t diff = (int32_t)(deviceTs - (uint32_t)this->clockRefTicks);
+	return this->clockRefTicks + diff;
+}
+
+/*
+ * NTP style estimate of offset and drift between device and host clock.
+ * Every query is taken as happening at the midpoint of its round trip. Only
+ * the faster half of all samples is used, the slow ones mostly waited in
+ * some queue. Offset and drift are a least squares fit of these, the drift
+ * stays at the nominal clock until the samples cover a second.
+ */
+bool FlashTrig::syncClock(int samples) {
+
+	const size_t maxSamples = 256;
+
+	for (int i = 0; i < samples; i++) {
+		ClockSample sample;
+		auto send = chrono::steady_clock::now();
+		uint32_t deviceTs = this->deviceTime();
+		auto recv = chrono::steady_clock::now();
+		if (!this->isOkay) {
+			return false;
+		}
+		sample.hostSendUs = chrono::duration<double, micro>(send.time_since_epoch()).count();
+		sample.hostRecvUs = chrono::duration<double, micro>(recv.time_since_epoch()).count();
+		sample.deviceTicks = this->unwrapDeviceTime(deviceTs);
+		this->clockRefTicks = sample.deviceTicks;
+		this->clockSamples.push_back(sample);
+	}
+	if (this->clockSamples.size() > maxSamples) {
+		this->clockSamples.erase(this->clockSamples.begin(), this->clockSamples.end() - maxSamples);
+	}
+
+	vector<ClockSample> best = this->clockSamples;
+	sort(best.begin(), best.end(), [](const ClockSample &a, const ClockSample &b) {
+		return (a.hostRecvUs - a.hostSendUs) < (b.hostRecvUs - b.hostSendUs);
+	});
+	best.resize((best.size() + 1) / 2);
+
+	// fit relative to the first sample to keep the doubles precise
+	double x0 = (double)best[0].deviceTicks;
+	double y0 = (best[0].hostSendUs + best[0].hostRecvUs) / 2;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0, minX = 0, maxX = 0;
+	for (const ClockSample &sample : best) {
+		double x = (double)sample.deviceTicks - x0;
+		double y = (sample.hostSendUs + sample.hostRecvUs) / 2 - y0;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+		minX = min(minX, x);
+		maxX = max(maxX, x);
+	}
+	double n = best.size();
+	double slope = 1000.0 / FT_TIMER_TICKS_PER_MS;
+	if ((maxX - minX) * slope >= 1e6 && n * sxx - sx * sx > 0) {
+		slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+	}
+	this->clockUsPerTick = slope;
+	this->clockOffsetUs = y0 + (sy - slope * sx) / n - slope * x0;
+	return true;
+}
+
+// converts a device time into the host steady clock, syncClock() must have run
+chrono::steady_clock::time_point FlashTrig::toHostTime(uint32_t deviceTs) {
+
+	double hostUs = this->clockOffsetUs + this->clockUsPerTick * (double)this->unwrapDeviceTime(deviceTs);
+	return chrono::steady_clock::time_point(
+		chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, micro>(hostUs)));
+}
+
+FlashTrig::~FlashTrig() {
+
+	this->stopSubmitter();
+	if (this->submitterWake >= 0) {
+		close(this->submitterWake);
+	}
+	if (this->eventThread.joinable()) {
+		this->eventStop = true;
+#if LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(this->context);
+#endif
+		this->eventThread.join();
+	}
+	if (this->hotplugRegistered) {
+		libusb_hotplug_deregister_callback(this->context, this->hotplugHandle);
+	}
+	if (this->arrived != NULL) {
+		libusb_unref_device(this->arrived);
+	}
+	if (this->outTransfer != NULL) {
+		libusb_free_transfer(this->outTransfer);
+	}
+	if (this->asyncSlot != NULL) {
+		this->waitAsync(0);
+	}
+	for (PoolSlot &slot : this->pool) {
+		if (slot.transfer != NULL) {
+			libusb_free_transfer(slot.transfer);
+		}
+	}
+	free(this->eventUrb);
+	free(this->outUrb);
+	if (this->handle != NULL) {
+		libusb_release_interface(this->handle, 0);
+		libusb_close(this->handle);
+	}
+	if (this->context != NULL) {
+		libusb_exit(this->context);
+	}
+	// after libusb, a wrapped node is still in use until libusb_close
+	if (this->devFd >= 0) {
+		close(this->devFd);
+	}
+}
+
+
+/*
+ * Sends the commands without data over the interrupt out endpoint instead
+ * of the control endpoint, with a transfer that is allocated only once.
+ * Fails on firmware without the endpoint.
+ */
+bool FlashTrig::useOutEndpoint(bool on) {
+
+	libusb_config_descriptor *config;
+	bool found = false;
+
+	if (this->backend == HIDRAW) {
+		// the output reports go to the interrupt out endpoint anyway
+		return on;
+	}
+	if (this->backend == USBFS) {
+		unsigned char desc[256];
+		int size;
+
+		if (!on || this->outUrb != NULL) {
+			if (!on) {
+				free(this->outUrb);
+				this->outUrb = NULL;
+			}
+			return true;
+		}
+		// the descriptors follow the device descriptor, look for the endpoint
+		size = pread(this->devFd, desc, sizeof(desc), 0);
+		for (int i = 0; i + 3 < size && desc[i] > 0; i += desc[i]) {
+			if (desc[i + 1] == 5 && desc[i + 2] == FT_OUT_ENDPOINT) {
+				found = true;
+			}
+		}
+		if (!found) {
+			return false;
+		}
+		this->outUrb = (usbdevfs_urb *)calloc(1, sizeof(usbdevfs_urb));
+		if (this->outUrb == NULL) {
+			return false;
+		}
+		this->outUrb->type = USBDEVFS_URB_TYPE_INTERRUPT;
+		this->outUrb->endpoint = FT_OUT_ENDPOINT;
+		this->outUrb->buffer = this->outBuffer;
+		this->outUrb->buffer_length = FT_OUT_SIZE;
+		return true;
+	}
+	if (!on) {
+		if (this->outTransfer != NULL) {
+			libusb_free_transfer(this->outTransfer);
+			this->outTransfer = NULL;
+		}
+		return true;
+	}
+	if (this->outTransfer != NULL) {
+		return true;
+	}
+
+	if (libusb_get_active_config_descriptor(libusb_get_device(this->handle), &config) < 0) {
+		return false;
+	}
+	const libusb_interface_descriptor *setting = &config->interface[0].altsetting[0];
+	for (int i = 0; i < setting->bNumEndpoints; i++) {
+		if (setting->endpoint[i].bEndpointAddress == FT_OUT_ENDPOINT) {
+			found = true;
+		}
+	}
+	libusb_free_config_descriptor(config);
+	if (!found) {
+		return false;
+	}
+
+	this->outTransfer = this->allocTransfer();
+	if (this->outTransfer == NULL) {
+		return false;
+	}
+	libusb_fill_interrupt_transfer(this->outTransfer, this->handle, FT_OUT_ENDPOINT, this->outBuffer,
+		FT_OUT_SIZE, FlashTrig::transferCallback, &this->outCompleted, usbTimeout);
+	return true;
+}
+
+// marks the transfer of user_data as completed, for the transfers waited for with libusb_handle_events_completed
+void LIBUSB_CALL FlashTrig::transferCallback(libusb_transfer *transfer) {
+
+	*(int *)transfer->user_data = 1;
+}
+
+// one command packet on the interrupt out endpoint, waits until the device took it
+bool FlashTrig::sendOut(int command, int usbValue, int usbIndex, int timeoutMs) {
+
+	int ret;
+
+	this->outBuffer[0] = FT_OUT_COMMAND;
+	this->outBuffer[1] = (unsigned char)command;
+	this->outBuffer[2] = (unsigned char)(usbValue & 0xFF);
+	this->outBuffer[3] = (unsigned char)((usbValue >> 8) & 0xFF);
+	this->outBuffer[4] = (unsigned char)(usbIndex & 0xFF);
+	this->outBuffer[5] = (unsigned char)((usbIndex >> 8) & 0xFF);
+
+	if (this->backend == USBFS) {
+		this->isOkay = this->usbfsSubmit(this->outUrb, timeoutMs) && this->outUrb->actual_length == FT_OUT_SIZE;
+		this->lastError = this->isOkay ? ERR_NONE : this->outUrb->status < 0 ? errorOfErrno(-this->outUrb->status) : ERR_FAILED;
+		return this->isOkay;
+	}
+
+	this->outCompleted = 0;
+	this->outTransfer->timeout = timeoutMs;
+	ret = libusb_submit_transfer(this->outTransfer);
+	if (ret < 0) {
+		this->lastError = errorOf(ret);
+		this->isOkay = false;
+		return false;
+	}
+	while (!this->outCompleted) {
+		ret = libusb_handle_events_completed(this->context, &this->outCompleted);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			// the transfer stays in use until its callback ran
+			libusb_cancel_transfer(this->outTransfer);
+		}
+	}
+
+	this->isOkay = this->outTransfer->status == LIBUSB_TRANSFER_COMPLETED
+		&& this->outTransfer->actual_length == FT_OUT_SIZE;
+	this->lastError = this->isOkay ? ERR_NONE
+		: this->outTransfer->status != LIBUSB_TRANSFER_COMPLETED ? errorOfStatus(this->outTransfer->status) : ERR_FAILED;
+	return this->isOkay;
+}
+
+/*
+ * A command as hid report: without data as output report on the interrupt
+ * out endpoint, with data or for a reply as feature report on the control
+ * endpoint. The reports have no report id, hidraw takes a leading 0 for it.
+ */
+bool FlashTrig::hidSend(int command, int usbValue, int usbIndex, unsigned char *data, int length, bool feature) {
+
+	unsigned char report[1 + FT_HID_FEATURE_SIZE];
+	int size = 1 + FT_OUT_SIZE + length;
+	int ret;
+
+	if (FT_OUT_SIZE + length > FT_HID_FEATURE_SIZE) {
+		this->lastError = ERR_OVERFLOW;
+		this->isOkay = false;
+		return false;
+	}
+	report[0] = 0;
+	report[1] = FT_OUT_COMMAND;
+	report[2] = (unsigned char)command;
+	report[3] = (unsigned char)(usbValue & 0xFF);
+	report[4] = (unsigned char)((usbValue >> 8) & 0xFF);
+	report[5] = (unsigned char)(usbIndex & 0xFF);
+	report[6] = (unsigned char)((usbIndex >> 8) & 0xFF);
+	if (length > 0) {
+		memcpy(report + 1 + FT_OUT_SIZE, data, length);
+	}
+
+	if (feature) {
+		ret = ioctl(this->devFd, HIDIOCSFEATURE(size), report);
+	} else {
+		ret = write(this->devFd, report, size);
+	}
+	this->isOkay = ret == size;
+	this->lastError = this->isOkay ? ERR_NONE : ret < 0 ? errorOfErrno(errno) : ERR_FAILED;
+	return this->isOkay;
+}
+
+// the command as feature report, its reply is the feature report read next
+void FlashTrig::hidQuery(int command, int count, unsigned char *reply) {
+
+	unsigned char report[1 + FT_HID_FEATURE_SIZE];
+	int size = 1 + min(count, FT_HID_FEATURE_SIZE);
+	int ret;
+
+	if (!this->hidSend(command, 0, 0, NULL, 0, true)) {
+		return;
+	}
+	report[0] = 0;
+	ret = ioctl(this->devFd, HIDIOCGFEATURE(size), report);
+	if (ret != 1 + count) {
+		this->lastError = ret < 0 ? errorOfErrno(errno) : ERR_FAILED;
+		this->isOkay = false;
+		return;
+	}
+	memcpy(reply, report + 1, count);
+	this->lastError = ERR_NONE;
+	this->isOkay = true;
+}
+
+bool FlashTrig::sendToDevice(int command, int usbValue, int usbIndex, unsigned char *data, int length) {
+
+	int sentBytes;
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+	int timeoutMs = this->timeoutFor(length == 0);
+
+	// fails at once while the controller is away, waitConnected() tells when to retry
+	if ((!this->connected && !this->replaying) || timeoutMs < 0) {
+		this->lastError = this->connected || this->replaying ? ERR_TIMEOUT : ERR_DISCONNECTED;
+		this->isOkay = false;
+		return false;
+	}
+
+	if (this->backend == HIDRAW) {
+		// hidraw has no timeout, the report is written or fails
+		this->hidSend(command, usbValue, usbIndex, data, length, length > 0);
+	} else if ((this->outTransfer != NULL || this->outUrb != NULL) && length == 0) {
+		this->sendOut(command, usbValue, usbIndex, timeoutMs);
+	} else {
+		if (this->backend == USBFS) {
+			sentBytes = this->usbfsControl(FT_REQ_OUT, command, usbValue, usbIndex, data, length, timeoutMs);
+			this->lastError = sentBytes < 0 ? errorOfErrno(errno) : ERR_FAILED;
+		} else {
+			sentBytes = this->pooledControl(FT_REQ_OUT, command, usbValue, usbIndex, data, length, timeoutMs);
+			this->lastError = sentBytes < 0 ? errorOf(sentBytes) : ERR_FAILED;
+		}
+		this->isOkay = sentBytes == length;
+		if (this->isOkay) {
+			this->lastError = ERR_NONE;
+		}
+	}
+
+	if (this->isOkay) {
+		this->remember(command, usbValue, usbIndex, data, length);
+	}
+	this->updateCache(command, usbValue, usbIndex, this->isOkay);
+	return this->isOkay;
+}
+
+bool FlashTrig::sendToDevice(int command, int usbValue, int usbIndex) {
+	return this->sendToDevice(command, usbValue, usbIndex, NULL, 0);
+}
+
+bool FlashTrig::sendToDevice(int command, int usbValue) {
+	return this->sendToDevice(command, usbValue, 0);
+}
+
+bool FlashTrig::sendToDevice(int command) {
+	return this->sendToDevice(command, 0);
+}
+
+void FlashTrig::queryDevice(int command, int count, unsigned char *reply) {
+
+	int recBytes;
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+	int timeoutMs = this->timeoutFor(false);
+
+	if ((!this->connected && !this->replaying) || timeoutMs < 0) {
+		this->lastError = this->connected || this->replaying ? ERR_TIMEOUT : ERR_DISCONNECTED;
+		this->isOkay = false;
+		return;
+	}
+
+	if (this->backend == HIDRAW) {
+		this->hidQuery(command, count, reply);
+		return;
+	}
+
+	// asks for exactly count bytes, a newer device may have more to say
+	if (this->backend == USBFS) {
+		recBytes = this->usbfsControl(FT_REQ_IN, command, 0, 0, reply, min(count, usbCount), timeoutMs);
+		this->lastError = recBytes < 0 ? errorOfErrno(errno) : ERR_FAILED;
+	} else {
+		recBytes = this->pooledControl(FT_REQ_IN, command, 0, 0, reply, min(count, usbCount), timeoutMs);
+		this->lastError = recBytes < 0 ? errorOf(recBytes) : ERR_FAILED;
+	}
+	if (recBytes != count) {
+		this->isOkay = false;
+		return;
+	} 
+	this->lastError = ERR_NONE;
+	this->isOkay = true;
+	return;
+}
+
+/*
+ * Keeps the last command of each setting of the controller, which a reset
+ * loses: flash time, light, channel times, light lead, armed shot, strobe,
+ * shutter lag, external trigger and the uploaded sequence.
+ */
+void FlashTrig::remember(int command, int usbValue, int usbIndex, unsigned char *data, int length) {
+
+	int setting;
+
+	switch (command) {
+	case FT_CMD_FLASH_TIME_SET:
+	case FT_CMD_FLASH_TIME_US_SET:
+		setting = FT_CMD_FLASH_TIME_US_SET;
+		break;
+	case FT_CMD_LIGHT_ON:
+	case FT_CMD_LIGHT_OFF:
+		setting = FT_CMD_LIGHT_ON;
+		break;
+	case FT_CMD_CHANNEL_TIME_SET:
+		setting = command | (usbIndex << 8);
+		break;
+	case FT_CMD_SEQ_UPLOAD:
+		setting = command | (usbValue << 8);
+		break;
+	case FT_CMD_LIGHT_LEAD_SET:
+	case FT_CMD_ARM:
+	case FT_CMD_STROBE_SET:
+	case FT_CMD_LAG_SETUP:
+	case FT_CMD_EXT_ARM:
+		setting = command;
+		break;
+	default:
+		return;
+	}
+
+	ReplayCommand &entry = this->replay[setting];
+	entry.command = command;
+	entry.value = usbValue;
+	entry.index = usbIndex;
+	entry.data.assign(data, data + length);
+}
+
+/*
+ * Follows the controller through resets and replugs: a hotplug callback
+ * notices the departure, commands fail at once until the controller is
+ * back, then a background thread reopens and claims it and replays the
+ * remembered configuration. The armed shot, the external trigger and the
+ * light are only restored with rearm. A controller that comes back on
+ * another port is not taken. Only for the libusb backend with bus scan.
+ */
+bool FlashTrig::enableReconnect(bool rearm) {
+
+	libusb_device *device;
+	uint8_t ports[8];
+	int depth;
+
+	if (this->eventThread.joinable()) {
+		return true;
+	}
+	if (this->backend != LIBUSB || this->devFd >= 0 || this->handle == NULL
+		|| !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		return false;
+	}
+
+	device = libusb_get_device(this->handle);
+	depth = libusb_get_port_numbers(device, ports, sizeof(ports));
+	this->busNumber = libusb_get_bus_number(device);
+	this->portPath.assign(ports, ports + max(depth, 0));
+	this->currentDevice = device;
+	this->rearm = rearm;
+
+	if (libusb_hotplug_register_callback(this->context,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+			DEV_VENDOR_CLASS, DEV_PRODUCT_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+			FlashTrig::hotplugCallback, this, &this->hotplugHandle) != LIBUSB_SUCCESS) {
+		return false;
+	}
+	this->hotplugRegistered = true;
+	this->eventThread = thread(&FlashTrig::eventLoop, this);
+	return true;
+}
+
+bool FlashTrig::samePort(libusb_device *device) {
+
+	uint8_t ports[8];
+	int depth = libusb_get_port_numbers(device, ports, sizeof(ports));
+
+	return libusb_get_bus_number(device) == this->busNumber && depth == (int)this->portPath.size()
+		&& equal(this->portPath.begin(), this->portPath.end(), ports);
+}
+
+/*
+ * Runs on whichever thread handles libusb events: the event thread, or a
+ * transfer of another thread waiting in sendOut() or pooledControl() with
+ * the device lock held. It only takes note under connectLock, the event
+ * thread reopens.
+ */
+int LIBUSB_CALL FlashTrig::hotplugCallback(libusb_context *, libusb_device *device,
+	libusb_hotplug_event event, void *user) {
+
+	FlashTrig *ft = (FlashTrig *)user;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT && device == ft->currentDevice) {
+		ft->connected = false;
+		lock_guard<mutex> lock(ft->connectLock);
+		ft->leftAt = chrono::steady_clock::now();
+		ft->reconnectState.connected = false;
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED && !ft->connected && ft->samePort(device)) {
+		lock_guard<mutex> lock(ft->connectLock);
+		if (ft->arrived != NULL) {
+			libusb_unref_device(ft->arrived);
+		}
+		ft->arrived = libusb_ref_device(device);
+		ft->reopenTries = 0;
+	}
+	return 0;
+}
+
+void FlashTrig::eventLoop() {
+
+	libusb_device *device;
+	timeval tv;
+
+	while (!this->eventStop) {
+		tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(this->context, &tv, NULL);
+
+		{
+			lock_guard<mutex> lock(this->connectLock);
+			device = this->arrived;
+			this->arrived = NULL;
+		}
+		if (device == NULL) {
+			continue;
+		}
+		if (this->reopen(device)) {
+			libusb_unref_device(device);
+			continue;
+		}
+		// a freshly enumerated device may refuse the first opens, it is tried once per round
+		lock_guard<mutex> lock(this->connectLock);
+		if (this->arrived != NULL || ++this->reopenTries >= reopenAttempts) {
+			// replaced by a newer arrival, or out of tries
+			libusb_unref_device(device);
+		} else {
+			this->arrived = device;
+		}
+	}
+}
+
+/*
+ * Opens and claims the arrived controller and replays the configuration,
+ * before other threads see it connected again. Arming commands and the
+ * light are only replayed with rearm, without it they are dropped, as the
+ * controller forgot them.
+ */
+bool FlashTrig::reopen(libusb_device *device) {
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+	bool out = this->outTransfer != NULL;
+
+	this->useOutEndpoint(false);
+	if (this->handle != NULL) {
+		// the interface of a departed device is gone with it
+		libusb_close(this->handle);
+		this->handle = NULL;
+	}
+	if (libusb_open(device, &this->handle) < 0) {
+		this->handle = NULL;
+		return false;
+	}
+	this->claim(true);
+	if (!this->isOkay) {
+		return false;
+	}
+	this->currentDevice = device;
+
+	// a reset controller starts over, the replay refills what was set
+	this->invalidateCache();
+
+	if (!this->rearm) {
+		// a replugged controller must not fire or light up on its own
+		this->replay.erase(FT_CMD_ARM);
+		this->replay.erase(FT_CMD_EXT_ARM);
+		this->replay.erase(FT_CMD_LIGHT_ON);
+	}
+
+	// a copy, the replay records itself again
+	map<int, ReplayCommand> settings = this->replay;
+	this->replaying = true;
+	for (auto &setting : settings) {
+		ReplayCommand &entry = setting.second;
+		this->sendToDevice(entry.command, entry.value, entry.index, entry.data.data(), entry.data.size());
+	}
+	if (out) {
+		this->useOutEndpoint(true);
+	}
+	this->replaying = false;
+	this->connected = true;
+
+	lock_guard<mutex> stateLock(this->connectLock);
+	this->reconnectState.connected = true;
+	this->reconnectState.reconnects++;
+	this->reconnectState.lastRecoveryMs = chrono::duration<double, milli>(chrono::steady_clock::now() - this->leftAt).count();
+	this->connectedCond.notify_all();
+	return true;
+}
+
+/*
+ * Follows the commands in the host side cache of light and flash time. A
+ * command that may have switched the light, now or later on the
+ * controller, drops it, as does a failed one that may have arrived.
+ */
+void FlashTrig::updateCache(int command, int usbValue, int usbIndex, bool sent) {
+
+	switch (command) {
+	case FT_CMD_FLASH_TIME_SET:
+	case FT_CMD_FLASH_TIME_US_SET:
+		if (!sent) {
+			this->forgetFlashTime();
+			break;
+		}
+		this->knownFlashTimeUs = command == FT_CMD_FLASH_TIME_SET ? (uint32_t)(usbValue & 0xFFFF) * 1000
+			: ((uint32_t)(usbIndex & 0xFFFF) << 16) | (usbValue & 0xFFFF);
+		this->flashTimeKnown = true;
+		break;
+	case FT_CMD_CHANNEL_ON:
+	case FT_CMD_CHANNEL_OFF:
+		if (!(usbValue & FT_CH_FLASH)) {
+			break;
+		}
+		// fall through
+	case FT_CMD_LIGHT_ON:
+	case FT_CMD_LIGHT_OFF:
+		// a running flash timer or lead switches the light again, until a status read shows it idle
+		if (!sent || this->lightTimed) {
+			this->forgetLight();
+			break;
+		}
+		this->lightOn = command == FT_CMD_LIGHT_ON || command == FT_CMD_CHANNEL_ON;
+		this->lightKnown = true;
+		break;
+	case FT_CMD_CHANNEL_PULSE:
+		if (usbValue & FT_CH_FLASH) {
+			this->lightTimed = true;
+			this->forgetLight();
+		}
+		break;
+	case FT_CMD_FLASH_AND_TRIGGER:
+	case FT_CMD_FIRE:
+	case FT_CMD_FRAME_FIRE:
+	case FT_CMD_FOCUS_FIRE:
+	case FT_CMD_SEQ_START:
+	case FT_CMD_SEQ_ABORT:
+	case FT_CMD_STROBE_RUN:
+		this->lightTimed = true;
+		this->forgetLight();
+		break;
+	}
+}
+
+void FlashTrig::forgetLight() {
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+
+	if (this->lightKnown) {
+		this->lightKnown = false;
+		this->cacheInvalidations++;
+	}
+}
+
+void FlashTrig::forgetFlashTime() {
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+
+	if (this->flashTimeKnown) {
+		this->flashTimeKnown = false;
+		this->cacheInvalidations++;
+	}
+}
+
+// an armed external trigger switches the light without the host, see remember()
+bool FlashTrig::extTriggerArmed() {
+
+	auto setting = this->replay.find(FT_CMD_EXT_ARM);
+
+	return setting != this->replay.end() && (setting->second.value & FT_EXT_ENABLE) != 0;
+}
+
+// the next lightState() and getFlashTime() query the controller
+void FlashTrig::invalidateCache() {
+
+	this->forgetLight();
+	this->forgetFlashTime();
+}
+
+CacheStats FlashTrig::cacheStats() {
+
+	CacheStats stats;
+
+	stats.hits = this->cacheHits;
+	stats.misses = this->cacheMisses;
+	stats.invalidations = this->cacheInvalidations;
+	return stats;
+}
+
+// waits up to timeoutMs for a reconnected controller, true at once if it is there
+bool FlashTrig::waitConnected(int timeoutMs) {
+
+	unique_lock<mutex> lock(this->connectLock);
+
+	return this->connectedCond.wait_for(lock, chrono::milliseconds(timeoutMs),
+		[this]() { return this->reconnectState.connected; });
+}
+
+ReconnectStatus FlashTrig::reconnectStatus() {
+
+	lock_guard<mutex> lock(this->connectLock);
+
+	return this->reconnectState;
+}
+
+/*
+ * Timeouts of the single transfers: commands without data, the triggers,
+ * fail fast, transfers with data and queries get longer. A deadline cuts
+ * both, see setDeadline().
+ */
+void FlashTrig::setTimeouts(int commandMs, int transferMs) {
+
+	this->commandTimeoutMs = max(commandMs, 1);
+	this->usbTimeout = max(transferMs, 1);
+}
+
+/*
+ * All commands and queries until clearDeadline() have to finish by until,
+ * e.g. the start of the next frame of a capture loop. Once it passed they
+ * fail with ERR_TIMEOUT without a transfer.
+ */
+void FlashTrig::setDeadline(chrono::steady_clock::time_point until) {
+
+	this->deadline = until;
+}
+
+void FlashTrig::clearDeadline() {
+
+	this->deadline = chrono::steady_clock::time_point::max();
+}
+
+// the timeout of the next transfer in ms, -1 if the deadline passed
+int FlashTrig::timeoutFor(bool command) {
+
+	int timeoutMs = command ? this->commandTimeoutMs : this->usbTimeout;
+
+	if (this->deadline != chrono::steady_clock::time_point::max()) {
+		auto left = chrono::duration_cast<chrono::milliseconds>(this->deadline - chrono::steady_clock::now()).count();
+		if (left <= 0) {
+			return -1;
+		}
+		timeoutMs = (int)min<long long>(timeoutMs, left);
+	}
+	return timeoutMs;
+}
+
+FlashTrig::Error FlashTrig::errorOf(int libusbError) {
+
+	switch (libusbError) {
+	case LIBUSB_SUCCESS:			return ERR_NONE;
+	case LIBUSB_ERROR_TIMEOUT:		return ERR_TIMEOUT;
+	case LIBUSB_ERROR_PIPE:			return ERR_STALL;
+	case LIBUSB_ERROR_NO_DEVICE:	return ERR_DISCONNECTED;
+	case LIBUSB_ERROR_OVERFLOW:		return ERR_OVERFLOW;
+	default:						return ERR_FAILED;
+	}
+}
+
+FlashTrig::Error FlashTrig::errorOfStatus(int transferStatus) {
+
+	switch (transferStatus) {
+	case LIBUSB_TRANSFER_COMPLETED:	return ERR_NONE;
+	case LIBUSB_TRANSFER_TIMED_OUT:	return ERR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:		return ERR_STALL;
+	case LIBUSB_TRANSFER_NO_DEVICE:	return ERR_DISCONNECTED;
+	case LIBUSB_TRANSFER_OVERFLOW:	return ERR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:	return ERR_CANCELLED;
+	default:						return ERR_FAILED;
+	}
+}
+
+// usbfs and hidraw, a discarded urb counts as timed out
+FlashTrig::Error FlashTrig::errorOfErrno(int err) {
+
+	switch (err) {
+	case ETIMEDOUT:
+	case ENOENT:
+	case ECONNRESET:	return ERR_TIMEOUT;
+	case EPIPE:			return ERR_STALL;
+	case ENODEV:
+	case ESHUTDOWN:		return ERR_DISCONNECTED;
+	case EOVERFLOW:		return ERR_OVERFLOW;
+	default:			return ERR_FAILED;
+	}
+}
+
+const char *FlashTrig::errorName(Error error) {
+
+	static const char *names[] = { "none", "timeout", "stall", "disconnected", "overflow", "cancelled", "failed", "busy" };
+
+	return names[error];
+}
+
+/*
+ * Submits the fire of the armed shot and returns at once, with a transfer
+ * of the pool. waitAsync() completes it, cancelAsync() takes it back if the
+ * shot is no longer wanted. One command at a time, libusb only.
+ */
+bool FlashTrig::fireAsync() {
+
+	return this->startAsync(FT_CMD_FIRE, 0, 0);
+}
+
+bool FlashTrig::startAsync(int command, int usbValue, int usbIndex) {
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+	int timeoutMs = this->timeoutFor(true);
+	int ret;
+
+	PoolSlot *slot;
+
+	this->isOkay = false;
+	if (this->backend != LIBUSB || !this->connected || timeoutMs < 0 || this->asyncSlot != NULL) {
+		this->lastError = !this->connected ? ERR_DISCONNECTED : timeoutMs < 0 ? ERR_TIMEOUT : ERR_FAILED;
+		return false;
+	}
+	slot = this->claimSlot(FT_REQ_OUT, command, usbValue, usbIndex, 0);
+	if (slot == NULL) {
+		this->lastError = ERR_BUSY;
+		return false;
+	}
+
+	libusb_fill_control_transfer(slot->transfer, this->handle, slot->buffer,
+		FlashTrig::transferCallback, &slot->completed, timeoutMs);
+	slot->completed = 0;
+	ret = libusb_submit_transfer(slot->transfer);
+	if (ret < 0) {
+		slot->completed = 1;
+		slot->busy.store(false, memory_order_release);
+		this->lastError = errorOf(ret);
+		return false;
+	}
+	this->asyncSlot = slot;
+	this->lastError = ERR_NONE;
+	this->isOkay = true;
+	return true;
+}
+
+// asks libusb to take the submitted command back, waitAsync() then reports ERR_CANCELLED
+bool FlashTrig::cancelAsync() {
+
+	if (this->asyncSlot == NULL || this->asyncSlot->completed) {
+		return false;
+	}
+	return libusb_cancel_transfer(this->asyncSlot->transfer) == LIBUSB_SUCCESS;
+}
+
+/*
+ * Waits up to timeoutMs for the submitted command. If it is still pending
+ * then, it is cancelled and reported as ERR_TIMEOUT, it may have reached
+ * the device anyway.
+ */
+FlashTrig::Error FlashTrig::waitAsync(int timeoutMs) {
+
+	auto until = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	bool expired = false;
+	PoolSlot *slot = this->asyncSlot;
+	timeval tv;
+
+	if (slot == NULL) {
+		return ERR_FAILED;
+	}
+	while (!slot->completed) {
+		auto left = chrono::duration_cast<chrono::microseconds>(until - chrono::steady_clock::now()).count();
+		if (left <= 0 && !expired) {
+			expired = true;
+			libusb_cancel_transfer(slot->transfer);
+		}
+		// after the cancel, the callback still has to run before the transfer is free
+		left = max<long long>(left, 1000);
+		tv.tv_sec = left / 1000000;
+		tv.tv_usec = left % 1000000;
+		libusb_handle_events_timeout_completed(this->context, &tv, &slot->completed);
+	}
+
+	lock_guard<recursive_mutex> lock(this->deviceLock);
+	this->lastError = errorOfStatus(slot->transfer->status);
+	this->asyncSlot = NULL;
+	slot->busy.store(false, memory_order_release);
+	if (expired && this->lastError == ERR_CANCELLED) {
+		this->lastError = ERR_TIMEOUT;
+	}
+	this->isOkay = this->lastError == ERR_NONE;
+	return this->lastError;
+}
+
+/*
+ * Starts the thread that drains posted commands to the device. Producers
+ * post into a bounded lock free queue and get a future of the completion,
+ * they never wait for the device or for each other. Direct calls of other
+ * threads wait for the device lock instead.
+ */
+bool FlashTrig::startSubmitter() {
+
+	int state = SUBMITTER_IDLE;
+
+	if (!this->submitterState.compare_exchange_strong(state, SUBMITTER_STARTING)) {
+		return state != SUBMITTER_STOPPING;
+	}
+	for (int i = 0; i < queueSize; i++) {
+		this->queue[i].sequence.store(i, memory_order_relaxed);
+	}
+	this->submitterWake = eventfd(0, EFD_CLOEXEC);
+	if (this->submitterWake < 0) {
+		this->submitterState = SUBMITTER_IDLE;
+		return false;
+	}
+	this->submitter = thread(&FlashTrig::submitLoop, this);
+	this->submitterState = SUBMITTER_RUNNING;
+	return true;
+}
+
+/*
+ * Refuses further posts, waits for the producers inside enqueue() to
+ * publish their slots, then lets the submitter complete what is left with
+ * ERR_CANCELLED, so that no future stays unsatisfied.
+ */
+void FlashTrig::stopSubmitter() {
+
+	int state = SUBMITTER_RUNNING;
+	uint64_t one = 1;
+
+	if (!this->submitterState.compare_exchange_strong(state, SUBMITTER_STOPPING)) {
+		return;
+	}
+	while (this->producers > 0) {
+		this_thread::yield();
+	}
+	this->submitterStop = true;
+	if (write(this->submitterWake, &one, sizeof(one)) < 0) {
+		cerr << "Could not wake the submitter" << endl;
+	}
+	this->submitter.join();
+}
+
+// a command, with up to queueData bytes of data; a full queue completes at once with ERR_BUSY
+future<FlashTrig::Result> FlashTrig::post(int command, int usbValue, int usbIndex, const unsigned char *data, int length) {
+
+	return this->enqueue(command, usbValue, usbIndex, data, length, 0);
+}
+
+// a query of count bytes, the reply of the future holds them
+future<FlashTrig::Result> FlashTrig::postQuery(int command, int count) {
+
+	// queries carry no value, as query<>()
+	return this->enqueue(command, 0, 0, NULL, 0, count);
+}
+
+/*
+ * A bounded queue of slots with sequence numbers: a producer claims a slot
+ * by advancing enqueuePos, fills it and publishes it with the sequence.
+ * The submitter is woken only if it sleeps.
+ */
+future<FlashTrig::Result> FlashTrig::enqueue(int command, int usbValue, int usbIndex,
+	const unsigned char *data, int length, int count) {
+
+	QueueSlot *slot;
+	size_t pos;
+
+	if (length > queueData || count > usbCount) {
+		promise<Result> refused;
+		refused.set_value(Result{ ERR_OVERFLOW, {} });
+		return refused.get_future();
+	}
+	// pairs with the stop, which sets the state before it waits for the producers
+	this->producers++;
+	if (this->submitterState != SUBMITTER_RUNNING) {
+		this->producers--;
+		promise<Result> refused;
+		refused.set_value(Result{ ERR_CANCELLED, {} });
+		return refused.get_future();
+	}
+
+	pos = this->enqueuePos.load(memory_order_relaxed);
+
+	while (true) {
+		slot = &this->queue[pos & (queueSize - 1)];
+		size_t sequence = slot->sequence.load(memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0) {
+			if (this->enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			this->producers--;
+			promise<Result> full;
+			full.set_value(Result{ ERR_BUSY, {} });
+			return full.get_future();
+		} else {
+			pos = this->enqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	slot->command = command;
+	slot->value = usbValue;
+	slot->index = usbIndex;
+	slot->length = length;
+	slot->count = count;
+	if (length > 0) {
+		memcpy(slot->data, data, length);
+	}
+	slot->result = promise<Result>();
+	future<Result> result = slot->result.get_future();
+	slot->sequence.store(pos + 1, memory_order_release);
+
+	// pairs with the fence of the submitter before it sleeps
+	atomic_thread_fence(memory_order_seq_cst);
+	if (this->submitterSleeping.exchange(false)) {
+		uint64_t one = 1;
+		if (write(this->submitterWake, &one, sizeof(one)) < 0) {
+			cerr << "Could not wake the submitter" << endl;
+		}
+	}
+	this->producers--;
+	return result;
+}
+
+void FlashTrig::submitLoop() {
+
+	uint64_t wakes;
+
+	while (true) {
+		QueueSlot *slot = &this->queue[this->dequeuePos & (queueSize - 1)];
+
+		if (slot->sequence.load(memory_order_acquire) != this->dequeuePos + 1) {
+			if (this->submitterStop) {
+				break;
+			}
+			this->submitterSleeping = true;
+			atomic_thread_fence(memory_order_seq_cst);
+			if (slot->sequence.load(memory_order_acquire) == this->dequeuePos + 1 || this->submitterStop) {
+				this->submitterSleeping = false;
+				continue;
+			}
+			if (read(this->submitterWake, &wakes, sizeof(wakes)) < 0 && errno != EINTR) {
+				break;
+			}
+			continue;
+		}
+
+		// the outcome goes into the result only, isOkay and lastError stay those of the direct calls
+		Result result;
+		if (this->submitterStop) {
+			result.error = ERR_CANCELLED;
+		} else {
+			lock_guard<recursive_mutex> lock(this->deviceLock);
+			bool okay = this->isOkay;
+			Error error = this->lastError;
+			if (slot->count > 0) {
+				result.reply.resize(slot->count);
+				this->queryDevice(slot->command, slot->count, result.reply.data());
+				if (!this->isOkay) {
+					result.reply.clear();
+				}
+			} else {
+				this->sendToDevice(slot->command, slot->value, slot->index, slot->length > 0 ? slot->data : NULL, slot->length);
+			}
+			result.error = this->lastError;
+			this->isOkay = okay;
+			this->lastError = error;
+		}
+		slot->result.set_value(move(result));
+		slot->sequence.store(this->dequeuePos + queueSize, memory_order_release);
+		this->dequeuePos++;
+	}
+}
+
+libusb_transfer *FlashTrig::allocTransfer() {
+
+	this->transferAllocs++;
+	return libusb_alloc_transfer(0);
+}
+
+/*
+ * Allocates the transfers of the pool once. A reclaim after a reconnect
+ * keeps them, the handle is filled in with each submit.
+ */
+void FlashTrig::fillPool() {
+
+	for (PoolSlot &slot : this->pool) {
+		if (slot.transfer == NULL) {
+			slot.transfer = this->allocTransfer();
+		}
+	}
+}
+
+// a free slot with the setup packet of command, NULL if all are in use or the data does not fit
+FlashTrig::PoolSlot *FlashTrig::claimSlot(int requestType, int command, int usbValue, int usbIndex, int length) {
+
+	if (length > usbCount) {
+		this->poolExhausted++;
+		return NULL;
+	}
+	for (PoolSlot &slot : this->pool) {
+		if (slot.transfer == NULL || slot.busy.exchange(true, memory_order_acquire)) {
+			continue;
+		}
+		this->poolClaims++;
+		libusb_fill_control_setup(slot.buffer, requestType, command, usbValue, usbIndex, length);
+		return &slot;
+	}
+	this->poolExhausted++;
+	return NULL;
+}
+
+/*
+ * libusb_control_transfer with a transfer of the pool instead of one
+ * allocated per call, same return values. Without a free slot it falls
+ * back to libusb_control_transfer.
+ */
+int FlashTrig::pooledControl(int requestType, int command, int usbValue, int usbIndex, unsigned char *data, int length, int timeoutMs) {
+
+	PoolSlot *slot = this->claimSlot(requestType, command, usbValue, usbIndex, length);
+	bool cancelled = false;
+	timeval tv;
+	int ret;
+
+	if (slot == NULL) {
+		return libusb_control_transfer(this->handle, requestType, command, usbValue, usbIndex, data, length, timeoutMs);
+	}
+	if (!(requestType & LIBUSB_ENDPOINT_IN) && length > 0) {
+		memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	}
+	libusb_fill_control_transfer(slot->transfer, this->handle, slot->buffer,
+		FlashTrig::transferCallback, &slot->completed, timeoutMs);
+	slot->completed = 0;
+	ret = libusb_submit_transfer(slot->transfer);
+	if (ret == LIBUSB_SUCCESS) {
+		// libusb times the transfer out itself, the bound only guards a failing event loop
+		auto until = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs + poolGraceMs);
+		while (!slot->completed) {
+			tv.tv_sec = 0;
+			tv.tv_usec = poolGraceMs * 1000;
+			ret = libusb_handle_events_timeout_completed(this->context, &tv, &slot->completed);
+			if (!slot->completed && !cancelled && ((ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+				|| (timeoutMs > 0 && chrono::steady_clock::now() > until))) {
+				// the transfer stays in use until its callback ran
+				libusb_cancel_transfer(slot->transfer);
+				cancelled = true;
+			}
+		}
+		switch (slot->transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			ret = slot->transfer->actual_length;
+			if (requestType & LIBUSB_ENDPOINT_IN) {
+				memcpy(data, slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, ret);
+			}
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:	ret = LIBUSB_ERROR_TIMEOUT; break;
+		case LIBUSB_TRANSFER_STALL:		ret = LIBUSB_ERROR_PIPE; break;
+		case LIBUSB_TRANSFER_NO_DEVICE:	ret = LIBUSB_ERROR_NO_DEVICE; break;
+		case LIBUSB_TRANSFER_OVERFLOW:	ret = LIBUSB_ERROR_OVERFLOW; break;
+		default:						ret = LIBUSB_ERROR_IO; break;
+		}
+	} else {
+		slot->completed = 1;
+	}
+	slot->busy.store(false, memory_order_release);
+	return ret;
+}
+
+PoolStats FlashTrig::poolStats() {
+
+	PoolStats stats;
+
+	stats.transferAllocs = this->transferAllocs;
+	stats.claims = this->poolClaims;
+	stats.exhausted = this->poolExhausted;
+	return stats;
+}
@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <libusb.h>
+#include <stdlib.h>
+#include <iostream>
+#include <unistd.h>
+#include <getopt.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include "../common/defines.h"
+#include "FlashTrig.cpp"
+
+using namespace std;
+
+void PrintHelp()
+{
+    std::cout <<
+    		" Measures the host side latency of FlashTrig operations." << endl <<
+    		" Every iteration really triggers the camera and flashes the light!" << endl << endl <<
+    		" Options " << endl <<
+            "  --iterations           -n <val>      Number of measured calls (default 100)" << endl <<
+            "  --fire                 -f            Compare fire() of an armed shot with flashAndTrigger()" << endl <<
+            "  --sync                 -s <frames>   Fire all connected controllers at the same usb frame, needs INT0 wired to D-" << endl <<
+            "  --out                  -o            Compare fire() on the control endpoint with the interrupt out endpoint" << endl <<
+            "  --usbfs                -u <path>     Compare control transfers of libusb with the usbfs node, e.g. /dev/bus/usb/001/004" << endl <<
+            "  --open                 -d <path>     Compare the startup of FlashTrig() with the libusb open of the usbfs node" << endl <<
+            "  --reconnect            -r <seconds>  Poll the status and report the recovery of each reset or replug meanwhile" << endl <<
+            "  --stress               -t <threads>  Post iterations commands per thread to the submitter, for 1 up to threads producers" << endl <<
+            "  --pool                 -p            Count the transfer allocations of commands and queries after the startup" << endl <<
+            "  --cache                -c            Compare cached reads of light and flash time with queries of the controller" << endl <<
+            "  --help                 -h            Print help" << endl ;
+
+    exit(1);
+}
+
+
+/* prints min, median, 99th percentile and max of the samples in microseconds */
+void PrintStats(const string &name, vector<double> samples)
+{
+	if (samples.empty()) {
+		cout << name << ": no samples" << endl;
+		return;
+	}
+	sort(samples.begin(), samples.end());
+	cout << name << ": "
+		<< "min " << samples.front() << "us, "
+		<< "median " << samples[samples.size() / 2] << "us, "
+		<< "p99 " << samples[(samples.size() * 99) / 100] << "us, "
+		<< "max " << samples.back() << "us" << endl;
+}
+
+/* times iterations calls of op, failed calls are not counted */
+vector<double> Measure(FlashTrig *ft, int iterations, function<void()> op)
+{
+	vector<double> samples;
+
+	for (int i = 0; i < iterations; i++) {
+		auto start = chrono::steady_clock::now();
+		op();
+		auto end = chrono::steady_clock::now();
+		if (ft->isOkay) {
+			samples.push_back(chrono::duration<double, micro>(end - start).count());
+		}
+	}
+	return samples;
+}
+
+
+void BenchFire(FlashTrig *ft, int iterations)
+{
+	// the same shot for both, short flash and default trigger pulse
+	ft->setFlashTimeUs(1000);
+	if (!ft->arm(1000, 0, 0, FT_CH_TRIGGER | FT_CH_FLASH)) {
+		cout << "Arming failed" << endl;
+		return;
+	}
+
+	PrintStats("flashAndTrigger()", Measure(ft, iterations, [ft]() { ft->flashAndTrigger(); }));
+	PrintStats("fire()           ", Measure(ft, iterations, [ft]() { ft->fire(); }));
+	PrintStats("fireAsync(), wait", Measure(ft, iterations, [ft]() { ft->fireAsync() && ft->waitAsync(50) == FlashTrig::ERR_NONE; }));
+}
+
+
+void BenchOut(FlashTrig *ft, int iterations)
+{
+	ft->setFlashTimeUs(1000);
+	if (!ft->arm(1000, 0, 0, FT_CH_TRIGGER | FT_CH_FLASH)) {
+		cout << "Arming failed" << endl;
+		return;
+	}
+
+	PrintStats("fire() control  ", Measure(ft, iterations, [ft]() { ft->fire(); }));
+	if (!ft->useOutEndpoint(true)) {
+		cout << "The controller has no interrupt out endpoint" << endl;
+		return;
+	}
+	PrintStats("fire() interrupt", Measure(ft, iterations, [ft]() { ft->fire(); }));
+	ft->useOutEndpoint(false);
+}
+
+
+/* control transfers without triggering, first through libusb, then through the usbfs node */
+void BenchUsbfs(const string &path, int iterations)
+{
+	FlashTrig *ft = new FlashTrig();
+
+	if (ft->isOkay) {
+		PrintStats("libusb setFlashTimeUs()", Measure(ft, iterations, [ft]() { ft->setFlashTimeUs(1000); }));
+		PrintStats("libusb status()        ", Measure(ft, iterations, [ft]() { ft->status(); }));
+	}
+	// releases the interface for the usbfs claim
+	delete ft;
+
+	ft = new FlashTrig(FlashTrig::USBFS, path.c_str());
+	if (!ft->isOkay) {
+		cout << "Could not open " << path << endl;
+		delete ft;
+		return;
+	}
+	PrintStats("usbfs setFlashTimeUs() ", Measure(ft, iterations, [ft]() { ft->setFlashTimeUs(1000); }));
+	PrintStats("usbfs status()         ", Measure(ft, iterations, [ft]() { ft->status(); }));
+	delete ft;
+}
+
+
+/* times iterations constructions, the destruction is not counted */
+vector<double> MeasureOpen(int iterations, function<FlashTrig *()> open)
+{
+	vector<double> samples;
+
+	for (int i = 0; i < iterations; i++) {
+		auto start = chrono::steady_clock::now();
+		FlashTrig *ft = open();
+		auto end = chrono::steady_clock::now();
+		if (ft->isOkay) {
+			samples.push_back(chrono::duration<double, micro>(end - start).count());
+		}
+		delete ft;
+	}
+	return samples;
+}
+
+
+void BenchOpen(const string &path, int iterations)
+{
+	// the scan first, older libusb keeps device discovery off for the process once it was disabled
+	PrintStats("FlashTrig()            ", MeasureOpen(iterations, []() { return new FlashTrig(); }));
+	PrintStats("FlashTrig(LIBUSB, path)", MeasureOpen(iterations, [&path]() { return new FlashTrig(FlashTrig::LIBUSB, path.c_str()); }));
+}
+
+
+void BenchReconnect(FlashTrig *ft, int seconds)
+{
+	vector<double> recoveries;
+	int reconnects = 0;
+
+	ft->setFlashTimeUs(1000);
+	if (!ft->enableReconnect()) {
+		cout << "No hotplug support" << endl;
+		return;
+	}
+	cout << "Reset or replug the controller now" << endl;
+
+	auto end = chrono::steady_clock::now() + chrono::seconds(seconds);
+	while (chrono::steady_clock::now() < end) {
+		ft->status();
+		if (!ft->isOkay) {
+			ft->waitConnected(100);
+		}
+		ReconnectStatus state = ft->reconnectStatus();
+		if (state.reconnects > reconnects) {
+			reconnects = state.reconnects;
+			recoveries.push_back(state.lastRecoveryMs * 1000);
+			cout << "reconnected after " << state.lastRecoveryMs << "ms, flash time "
+				<< ft->getFlashTimeUs() << "us" << endl;
+		}
+		this_thread::sleep_for(chrono::milliseconds(10));
+	}
+	PrintStats("recovery", recoveries);
+}
+
+
+/* throughput of the submitter with a growing number of producers, without triggering */
+void BenchStress(FlashTrig *ft, int iterations, int maxThreads)
+{
+	if (!ft->startSubmitter()) {
+		cout << "Could not start the submitter" << endl;
+		return;
+	}
+
+	for (int threads = 1; threads <= maxThreads; threads *= 2) {
+		atomic<int> done{0}, failed{0}, busy{0};
+		vector<thread> producers;
+
+		auto start = chrono::steady_clock::now();
+		for (int t = 0; t < threads; t++) {
+			producers.push_back(thread([&]() {
+				vector<future<FlashTrig::Result>> results;
+				for (int i = 0; i < iterations; i++) {
+					future<FlashTrig::Result> result = ft->post<FT_CMD_FLASH_TIME_US_SET>(1000);
+					// a full queue is reported at once, the producer decides to retry
+					while (result.wait_for(chrono::seconds(0)) == future_status::ready) {
+						FlashTrig::Result early = result.get();
+						if (early.error != FlashTrig::ERR_BUSY) {
+							failed += early.error != FlashTrig::ERR_NONE;
+							break;
+						}
+						busy++;
+						this_thread::yield();
+						result = ft->post<FT_CMD_FLASH_TIME_US_SET>(1000);
+					}
+					results.push_back(move(result));
+				}
+				for (auto &result : results) {
+					if (result.valid() && result.get().error != FlashTrig::ERR_NONE) {
+						failed++;
+					}
+					done++;
+				}
+			}));
+		}
+		for (thread &producer : producers) {
+			producer.join();
+		}
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		cout << threads << " producers: " << (int)(done / seconds) << " commands/s, "
+			<< failed << " failed, " << busy << " busy retries" << endl;
+	}
+}
+
+
+void BenchPool(FlashTrig *ft, int iterations)
+{
+	PoolStats before = ft->poolStats();
+
+	PrintStats("setFlashTimeUs()", Measure(ft, iterations, [ft]() { ft->setFlashTimeUs(1000); }));
+	PrintStats("status()        ", Measure(ft, iterations, [ft]() { ft->status(); }));
+
+	PoolStats after = ft->poolStats();
+	cout << after.transferAllocs - before.transferAllocs << " transfers allocated during "
+		<< 2 * iterations << " transfers, " << after.claims - before.claims << " pool claims, "
+		<< after.exhausted - before.exhausted << " without a free slot" << endl;
+}
+
+
+void BenchCache(FlashTrig *ft, int iterations)
+{
+	ft->setLight(false);
+	ft->setFlashTimeUs(1000);
+	CacheStats before = ft->cacheStats();
+
+	PrintStats("lightState()          ", Measure(ft, iterations, [ft]() { ft->lightState(); }));
+	PrintStats("lightState(true)      ", Measure(ft, iterations, [ft]() { ft->lightState(true); }));
+	PrintStats("getFlashTimeUs()      ", Measure(ft, iterations, [ft]() { ft->getFlashTimeUs(); }));
+	PrintStats("getFlashTimeUs(true)  ", Measure(ft, iterations, [ft]() { ft->getFlashTimeUs(true); }));
+
+	CacheStats after = ft->cacheStats();
+	cout << after.hits - before.hits << " hits, " << after.misses - before.misses << " misses, "
+		<< after.invalidations - before.invalidations << " invalidations" << endl;
+}
+
+
+void BenchSync(int iterations, uint16_t leadFrames)
+{
+	vector<FlashTrig *> devices;
+	vector<double> spreads;
+	vector<double> bounds;
+	double spreadUs, boundUs;
+
+	for (int i = 0; ; i++) {
+		FlashTrig *ft = new FlashTrig(i);
+		if (!ft->isOkay) {
+			delete ft;
+			break;
+		}
+		ft->arm(1000, 0, 0, FT_CH_TRIGGER | FT_CH_FLASH);
+		devices.push_back(ft);
+	}
+	cout << devices.size() << " controllers found" << endl;
+
+	for (FlashTrig *ft : devices) {
+		if (!ft->framesCounted()) {
+			cout << "A controller does not count the usb frames, INT0 must be wired to D-" << endl;
+			iterations = 0;
+			break;
+		}
+	}
+
+	for (int i = 0; i < iterations && !devices.empty(); i++) {
+		if (FlashTrig::fireSynchronized(devices, leadFrames, &spreadUs, &boundUs)) {
+			spreads.push_back(spreadUs);
+			bounds.push_back(boundUs);
+		}
+	}
+	cout << spreads.size() << " of " << iterations << " synchronized shots fired" << endl;
+	PrintStats("spread of the reported fire delays", spreads);
+	PrintStats("error bound of the frame offsets", bounds);
+
+	for (FlashTrig *ft : devices) {
+		delete ft;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	int iterations = 100;
+	bool benchFire = false;
+	bool benchOut = false;
+	int syncFrames = 0;
+	string usbfsPath;
+	string openPath;
+	int reconnectSeconds = 0;
+	int stressThreads = 0;
+	bool benchPool = false;
+	bool benchCache = false;
+
+	static struct option long_opts[] = {
+		{"iterations",		required_argument, 	0,  'n' },
+		{"fire",			no_argument, 		0,  'f' },
+		{"sync",			required_argument, 	0,  's' },
+		{"out",				no_argument, 		0,  'o' },
+		{"usbfs",			required_argument, 	0,  'u' },
+		{"open",			required_argument, 	0,  'd' },
+		{"reconnect",		required_argument, 	0,  'r' },
+		{"stress",			required_argument, 	0,  't' },
+		{"pool",			no_argument, 		0,  'p' },
+		{"cache",			no_argument, 		0,  'c' },
+		{"help",  			no_argument, 		0,  'h' },
+		{0,					0,					0,   0 }
+	};
+
+	while (true) {
+		const auto opt = getopt_long(argc, argv, "hn:fs:ou:d:r:t:pc", long_opts, nullptr);
+
+		if (-1 == opt)
+			break;
+
+		if(opt == 'n') {
+			iterations = stoi(optarg);
+			continue;
+		}
+		if(opt == 'f') {
+			benchFire = true;
+			continue;
+		}
+		if(opt == 's') {
+			syncFrames = stoi(optarg);
+			continue;
+		}
+		if(opt == 'o') {
+			benchOut = true;
+			continue;
+		}
+		if(opt == 'u') {
+			usbfsPath = optarg;
+			continue;
+		}
+		if(opt == 'd') {
+			openPath = optarg;
+			continue;
+		}
+		if(opt == 'r') {
+			reconnectSeconds = stoi(optarg);
+			continue;
+		}
+		if(opt == 't') {
+			stressThreads = stoi(optarg);
+			continue;
+		}
+		if(opt == 'p') {
+			benchPool = true;
+			continue;
+		}
+		if(opt == 'c') {
+			benchCache = true;
+			continue;
+		}
+
+		PrintHelp();
+	}
+
+	if (syncFrames > 0) {
+		BenchSync(iterations, syncFrames);
+		return 0;
+	}
+	if (!usbfsPath.empty()) {
+		BenchUsbfs(usbfsPath, iterations);
+		return 0;
+	}
+	if (!openPath.empty()) {
+		BenchOpen(openPath, iterations);
+		return 0;
+	}
+
+	if (!benchFire && !benchOut && reconnectSeconds == 0 && stressThreads == 0 && !benchPool && !benchCache) {
+		PrintHelp();
+	}
+
+	FlashTrig * ft = new FlashTrig();
+
+	if (!ft->isOkay)
+	{
+		cout << "FlashTrig failed initialisation" << endl;
+		exit(1);
+	}
+
+	if (benchFire) {
+		BenchFire(ft, iterations);
+	}
+	if (benchOut) {
+		BenchOut(ft, iterations);
+	}
+	if (reconnectSeconds > 0) {
+		BenchReconnect(ft, reconnectSeconds);
+	}
+	if (stressThreads > 0) {
+		BenchStress(ft, iterations, stressThreads);
+	}
+	if (benchPool) {
+		BenchPool(ft, iterations);
+	}
+	if (benchCache) {
+		BenchCache(ft, iterations);
+	}
+
+	delete ft;
+	return 0;
+}
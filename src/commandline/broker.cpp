@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <libusb.h>
+#include <stdlib.h>
+#include <iostream>
+#include <unistd.h>
+#include <getopt.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "../common/defines.h"
+#include "FlashTrig.cpp"
+
+using namespace std;
+
+void PrintHelp()
+{
+    std::cout <<
+    		" Opens the nodes of the flashtrig controllers for unprivileged processes" << endl <<
+    		" and passes them over a unix socket, see FlashTrig::brokerFd()." << endl <<
+    		" Runs as root, or as a user with r/w rights on the nodes." << endl << endl <<
+    		" Options " << endl <<
+            "  --socket               -s <path>     Socket to listen on (default " FT_BROKER_SOCKET ")" << endl <<
+            "  --group                -g <name>     Allow the members of this group" << endl <<
+            "  --user                 -u <uid>      Allow this user, can be repeated" << endl <<
+            "  --help                 -h            Print help" << endl ;
+
+    exit(1);
+}
+
+
+/* root, the listed users and the members of the group, also by a supplementary group */
+bool Allowed(const ucred &cred, gid_t group, const vector<uid_t> &users)
+{
+	if (cred.uid == 0 || find(users.begin(), users.end(), cred.uid) != users.end()) {
+		return true;
+	}
+	if (group == (gid_t)-1) {
+		return false;
+	}
+	if (cred.gid == group) {
+		return true;
+	}
+
+	passwd *pw = getpwuid(cred.uid);
+	if (pw == NULL) {
+		return false;
+	}
+	int count = 64;
+	vector<gid_t> groups(count);
+	if (getgrouplist(pw->pw_name, pw->pw_gid, groups.data(), &count) < 0) {
+		groups.resize(count);
+		getgrouplist(pw->pw_name, pw->pw_gid, groups.data(), &count);
+	}
+	groups.resize(count);
+	return find(groups.begin(), groups.end(), group) != groups.end();
+}
+
+
+/*
+ * One request of a client: the backend and the index of the controller.
+ * The reply is one byte, 0 or an errno, with the opened node on success.
+ */
+void Serve(int client, gid_t group, const vector<uid_t> &users)
+{
+	ucred cred;
+	socklen_t credLen = sizeof(cred);
+	unsigned char request[2];
+	unsigned char reply = 0;
+	string path;
+	int fd = -1;
+
+	// a client that sends nothing must not stall the others
+	timeval timeout = { 1, 0 };
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	// the credentials of the peer are taken by the kernel at connect, not from the client
+	if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) < 0
+		|| read(client, request, sizeof(request)) != sizeof(request)) {
+		return;
+	}
+
+	if (!Allowed(cred, group, users)) {
+		reply = EACCES;
+	} else if (request[0] > FlashTrig::USBFS) {
+		reply = EINVAL;
+	} else {
+		path = FlashTrig::devicePath((FlashTrig::Backend)request[0], request[1]);
+		if (path.empty()) {
+			reply = ENODEV;
+		} else {
+			fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+			reply = fd < 0 ? errno : 0;
+		}
+	}
+	cout << "pid " << cred.pid << " uid " << cred.uid << ": "
+		<< (path.empty() ? "-" : path) << " " << (reply == 0 ? "passed" : strerror(reply)) << endl;
+
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	iovec iov = { &reply, 1 };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	sendmsg(client, &msg, MSG_NOSIGNAL);
+
+	// the client holds its own reference now
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	string socketPath = FT_BROKER_SOCKET;
+	gid_t group = (gid_t)-1;
+	vector<uid_t> users;
+	sockaddr_un addr = {};
+	int sock, client;
+
+	static struct option long_opts[] = {
+		{"socket",			required_argument, 	0,  's' },
+		{"group",			required_argument, 	0,  'g' },
+		{"user",			required_argument, 	0,  'u' },
+		{"help",  			no_argument, 		0,  'h' },
+		{0,					0,					0,   0 }
+	};
+
+	while (true) {
+		const auto opt = getopt_long(argc, argv, "hs:g:u:", long_opts, nullptr);
+
+		if (-1 == opt)
+			break;
+
+		if(opt == 's') {
+			socketPath = optarg;
+			continue;
+		}
+		if(opt == 'g') {
+			struct group *gr = getgrnam(optarg);
+			if (gr == NULL) {
+				cerr << "Unknown group " << optarg << endl;
+				exit(1);
+			}
+			group = gr->gr_gid;
+			continue;
+		}
+		if(opt == 'u') {
+			users.push_back(stoi(optarg));
+			continue;
+		}
+
+		PrintHelp();
+	}
+
+	if (group == (gid_t)-1 && users.empty()) {
+		cerr << "Nobody but root is allowed, use --group or --user" << endl;
+	}
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+	unlink(socketPath.c_str());
+	if (sock < 0 || bind(sock, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 8) < 0) {
+		cerr << "Could not listen on " << socketPath << endl;
+		exit(1);
+	}
+	// anybody may connect, the credentials decide
+	chmod(socketPath.c_str(), 0666);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (true) {
+		client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0) {
+			continue;
+		}
+		Serve(client, group, users);
+		close(client);
+	}
+	return 0;
+}
@@ -10,17 +10,59 @@
 
 using namespace std;
 
+/* actions of the command line that are not one protocol command, past the 8 bit command codes */
+enum { ACTION_STROBE_STOP = 0x100, ACTION_WAIT_EVENTS };
+
+/* prints the trace of the controller as a timeline in ms from its first entry */
+void PrintTrace(const vector<TraceEntry> &entries)
+{
+	static const char *names[] = { "?", "command", "on", "off", "sequence", "frame fired",
+		"external trigger", "flash sync", "strobe" };
+
+	for (const TraceEntry &entry : entries) {
+		double ms = (uint32_t)(entry.deviceTime - entries[0].deviceTime) / (double)FT_TIMER_TICKS_PER_MS;
+		printf("%12.3fms  %-16s 0x%02x\n", ms, names[entry.type < 9 ? entry.type : 0], entry.arg);
+	}
+}
+
 void PrintHelp()
 {
     std::cout <<
     		" Options " << endl << 
             "  --trigger              -t            Trigger the camera, but don't flash" << endl <<
             "  --flash-and-trigger    -f            Trigger the camere, also flash" << endl <<
+            "  --prefocus             -P <ms>       Half press the camera for ms to wake it and focus" << endl <<
+            "  --focus-fire           -F <ms>       Half press, then flash and trigger after ms" << endl <<
             "  --light-on             -o            Turn the light on" << endl <<
             "  --light-off            -l            Turn the light off" << endl <<
             "  --light-state          -c            Fetch the light state [0|1]" << endl <<
             "  --set-flash-time       -s <val>      Set the time, the flash is on when flash-and-triggering" << endl <<
             "  --get-flash-time       -i            Fetch the set flash time" << endl <<
+            "  --strobe               -b <hz>,<duty>,<n>[,<ms>]  Pulse the light n times (0 until stopped) at hz with duty 0-1," << endl <<
+            "                                       with ms: hold the trigger, strobe ms later and release it after the last pulse" << endl <<
+            "  --strobe-stop          -k            Stop the strobe" << endl <<
+            "  --light-lead           -e <ms>,<ms>  Switch the light on ms before the trigger, off ms after it (0 flash time)" << endl <<
+            "  --set-flash-time-us    -u <val>      Set the flash time in microseconds" << endl <<
+            "  --get-flash-time-us    -g            Fetch the set flash time in microseconds" << endl <<
+            "  --channel-on           -O <mask>     Turn the channels of mask on (1 trigger, 2 flash, 4/8/16 aux 0-2, 32 focus)" << endl <<
+            "  --channel-off          -L <mask>     Turn the channels of mask off" << endl <<
+            "  --channel-pulse        -p <mask>     Turn the channels of mask on, each for its set time" << endl <<
+            "  --channel-time         -T <ch>=<ms>  Set the pulse time of channel number ch" << endl <<
+            "  --channel-state        -C            Fetch the mask of active channels" << endl <<
+            "  --ext-arm              -x <edge>     Arm the external trigger input, edge is rising or falling[,<debounce ms>]" << endl <<
+            "  --ext-disarm           -X            Disarm the external trigger input" << endl <<
+            "  --ext-wait             -w <n>        Wait for n external trigger events and print them" << endl <<
+            "  --shutter-lag-setup    -m <edge>     Measure the shutter lag on the rising or falling sync edge, or off" << endl <<
+            "  --shutter-lag          -S            Fetch the shutter lag of the last shots" << endl <<
+            "  --status               -A            Fetch all state of the controller at once" << endl <<
+            "  --trace                -r            Print the trace of the controller as a timeline and restart it" << endl <<
+            "  --clock                -K            Fetch the correction of the controller clock against the usb frames" << endl <<
+            "  --sequence-status      -q            Fetch the state of the sequence on the controller" << endl <<
+            "  --sequence-abort       -a            Abort a running sequence" << endl <<
+            "  --hidraw               -H <path>     Reach the controller through its hidraw node, before the command" << endl <<
+            "  --usbfs                -U <path>     Reach the controller through its usbfs node, before the command" << endl <<
+            "  --device               -D <path>     Open the usbfs node with libusb without a bus scan, before the command" << endl <<
+            "  --broker               -B            Get the opened controller from flashtrig-broker, before the command" << endl <<
             "  --help                 -h            Print help" << endl ;
 
     exit(1);
@@ -32,24 +74,72 @@ int main(int argc, char *argv[])
 	// Parse arguments	
 	int num = 0;
 	bool state = false;
+	SeqStatus seqStatus;
+	int channelMask = 0;
+	int channel = 0;
+	uint16_t channelTime = 0;
 	uint16_t time = -1;
+	uint32_t timeUs = -1;
 	int selectedCommand = 0;
+	uint8_t extFlags = 0;
+	uint16_t extDebounce = 0;
+	int extEvents = 0;
+	ExtEvent extEvent;
+	string lagEdge;
+	string hidrawPath;
+	string usbfsPath;
+	string devicePath;
+	bool broker = false;
+	uint16_t leadMs = 0, tailMs = 0;
+	double strobeHz = 0, strobeDuty = 0;
+	int strobePulses = 0, strobeDelay = -1;
+	ShutterLag lag;
+	DeviceStatus status;
+	ClockCalibration clock;
+	DeviceCounters counters;
+	vector<TraceEntry> traceEntries;
 
 	static struct option long_opts[] = {
 		{"trigger",			no_argument, 		0,  't' },
 		{"flash-and-trigger", no_argument,		0,  'f' },
+		{"prefocus",		required_argument,	0,  'P' },
+		{"focus-fire",		required_argument,	0,  'F' },
 		{"light-on",  		no_argument, 		0,  'o' },
 		{"light-off", 		no_argument,		0,  'l' },
 		{"light-state",  	no_argument, 		0,  'c' },
 		{"help",  			no_argument, 		0,  'h' },
 		{"set-flash-time",	required_argument, 	0,  's' },
 		{"get-flash-time",	no_argument, 		0,  'i' },
+		{"strobe",			required_argument,	0,  'b' },
+		{"strobe-stop",		no_argument,		0,  'k' },
+		{"light-lead",		required_argument,	0,  'e' },
+		{"set-flash-time-us", required_argument, 0, 'u' },
+		{"get-flash-time-us", no_argument,		0,  'g' },
+		{"channel-on",		required_argument,	0,  'O' },
+		{"channel-off",		required_argument,	0,  'L' },
+		{"channel-pulse",	required_argument,	0,  'p' },
+		{"channel-time",	required_argument,	0,  'T' },
+		{"channel-state",	no_argument,		0,  'C' },
+		{"ext-arm",			required_argument,	0,  'x' },
+		{"ext-disarm",		no_argument,		0,  'X' },
+		{"ext-wait",		required_argument,	0,  'w' },
+		{"shutter-lag-setup", required_argument, 0, 'm' },
+		{"shutter-lag",		no_argument,		0,  'S' },
+		{"status",			no_argument,		0,  'A' },
+		{"trace",			no_argument,		0,  'r' },
+		{"clock",			no_argument,		0,  'K' },
+		{"sequence-status",	no_argument,		0,  'q' },
+		{"sequence-abort",	no_argument,		0,  'a' },
+		{"hidraw",			required_argument,	0,  'H' },
+		{"usbfs",			required_argument,	0,  'U' },
+		{"device",			required_argument,	0,  'D' },
+		{"broker",			no_argument,		0,  'B' },
 		{0,					0,					0,   0 }
 	};
 
 
 	while (true) {
-        const auto opt = getopt_long(argc, argv, "htfolcsig", long_opts, nullptr);
+        const auto opt = getopt_long(argc, argv, "htfP:F:olcs:ie:b:ku:gqaO:L:p:T:Cx:Xw:m:SArKH:U:D:B", long_opts, nullptr);
 
         if (-1 == opt)
             break;
@@ -58,6 +148,22 @@ int main(int argc, char *argv[])
     		PrintHelp();
     		break;
 		}
+		if(opt == 'H') {
+			hidrawPath = optarg;
+			continue;
+		}
+		if(opt == 'U') {
+			usbfsPath = optarg;
+			continue;
+		}
+		if(opt == 'D') {
+			devicePath = optarg;
+			continue;
+		}
+		if(opt == 'B') {
+			broker = true;
+			continue;
+		}
 		if(opt == 't') {
 			selectedCommand = FT_CMD_TRIGGER;
 			break;
@@ -66,6 +172,16 @@ int main(int argc, char *argv[])
 			selectedCommand = FT_CMD_FLASH_AND_TRIGGER;
 			break;
 		}
+		if(opt == 'P') {
+			selectedCommand = FT_CMD_PREFOCUS;
+			time = stoi(optarg);
+			break;
+		}
+		if(opt == 'F') {
+			selectedCommand = FT_CMD_FOCUS_FIRE;
+			time = stoi(optarg);
+			break;
+		}
 		if(opt == 'o') {
 			selectedCommand = FT_CMD_LIGHT_ON;
 			break;
@@ -87,13 +203,141 @@ int main(int argc, char *argv[])
 			selectedCommand = FT_CMD_FLASH_TIME_GET;
 			break;
 		}
+		if(opt == 'e') {
+			size_t pos;
+			selectedCommand = FT_CMD_LIGHT_LEAD_SET;
+			leadMs = stoi(optarg, &pos);
+			if (optarg[pos] != ',') {
+				PrintHelp();
+			}
+			tailMs = stoi(optarg + pos + 1);
+			break;
+		}
+		if(opt == 'b') {
+			selectedCommand = FT_CMD_STROBE_RUN;
+			if (sscanf(optarg, "%lf,%lf,%d,%d", &strobeHz, &strobeDuty, &strobePulses, &strobeDelay) < 3) {
+				PrintHelp();
+			}
+			break;
+		}
+		if(opt == 'k') {
+			selectedCommand = ACTION_STROBE_STOP;
+			break;
+		}
+		if(opt == 'u') {
+			selectedCommand = FT_CMD_FLASH_TIME_US_SET;
+			timeUs = stoul(optarg);
+			break;
+		}
+		if(opt == 'g') {
+			selectedCommand = FT_CMD_FLASH_TIME_US_GET;
+			break;
+		}
+		if(opt == 'O') {
+			selectedCommand = FT_CMD_CHANNEL_ON;
+			channelMask = stoi(optarg, nullptr, 0);
+			break;
+		}
+		if(opt == 'L') {
+			selectedCommand = FT_CMD_CHANNEL_OFF;
+			channelMask = stoi(optarg, nullptr, 0);
+			break;
+		}
+		if(opt == 'p') {
+			selectedCommand = FT_CMD_CHANNEL_PULSE;
+			channelMask = stoi(optarg, nullptr, 0);
+			break;
+		}
+		if(opt == 'T') {
+			size_t pos;
+			selectedCommand = FT_CMD_CHANNEL_TIME_SET;
+			channel = stoi(optarg, &pos);
+			if (optarg[pos] != '=') {
+				PrintHelp();
+			}
+			channelTime = stoi(optarg + pos + 1);
+			break;
+		}
+		if(opt == 'C') {
+			selectedCommand = FT_CMD_CHANNEL_GET;
+			break;
+		}
+		if(opt == 'x') {
+			string arg = optarg;
+			size_t comma = arg.find(',');
+			selectedCommand = FT_CMD_EXT_ARM;
+			// rearmed with pull up, as for a light barrier
+			extFlags = FT_EXT_REARM | FT_EXT_PULLUP;
+			if (arg.substr(0, comma) == "rising") {
+				extFlags |= FT_EXT_RISING;
+			} else if (arg.substr(0, comma) != "falling") {
+				PrintHelp();
+			}
+			if (comma != string::npos) {
+				extDebounce = stoi(arg.substr(comma + 1));
+			}
+			break;
+		}
+		if(opt == 'X') {
+			selectedCommand = FT_CMD_EXT_ARM;
+			extFlags = 0;
+			break;
+		}
+		if(opt == 'w') {
+			selectedCommand = ACTION_WAIT_EVENTS;
+			extEvents = stoi(optarg);
+			break;
+		}
+		if(opt == 'm') {
+			selectedCommand = FT_CMD_LAG_SETUP;
+			lagEdge = optarg;
+			if (lagEdge != "rising" && lagEdge != "falling" && lagEdge != "off") {
+				PrintHelp();
+			}
+			break;
+		}
+		if(opt == 'S') {
+			selectedCommand = FT_CMD_LAG_GET;
+			break;
+		}
+		if(opt == 'A') {
+			selectedCommand = FT_CMD_STATUS;
+			break;
+		}
+		if(opt == 'r') {
+			selectedCommand = FT_CMD_TRACE_GET;
+			break;
+		}
+		if(opt == 'K') {
+			selectedCommand = FT_CMD_CLOCK_GET;
+			break;
+		}
+		if(opt == 'q') {
+			selectedCommand = FT_CMD_SEQ_STATUS;
+			break;
+		}
+		if(opt == 'a') {
+			selectedCommand = FT_CMD_SEQ_ABORT;
+			break;
+		}
 		
 		PrintHelp();
 		break;
 	}
 
 	// Init Flashtrig device
-	FlashTrig * ft = new FlashTrig();
+	FlashTrig * ft;
+	if (broker) {
+		ft = new FlashTrig(FlashTrig::LIBUSB, FlashTrig::brokerFd(FlashTrig::LIBUSB, 0));
+	} else if (!usbfsPath.empty()) {
+		ft = new FlashTrig(FlashTrig::USBFS, usbfsPath.c_str());
+	} else if (!devicePath.empty()) {
+		ft = new FlashTrig(FlashTrig::LIBUSB, devicePath.c_str());
+	} else if (!hidrawPath.empty()) {
+		ft = new FlashTrig(FlashTrig::HIDRAW, hidrawPath.c_str());
+	} else {
+		ft = new FlashTrig();
+	}
 
 	if (!ft->isOkay)
 	{
@@ -117,6 +361,18 @@ int main(int argc, char *argv[])
 			ft->isOkay ? cout << "successful" : cout << "failed";
 			break;
 
+		case FT_CMD_PREFOCUS:
+			cout << "Focusing ";
+			ft->prefocus(time);
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case FT_CMD_FOCUS_FIRE:
+			cout << "Focusing, then flash and triggering ";
+			ft->prefocusAndFire(time);
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
 		case FT_CMD_LIGHT_ON:
 			cout << "Turning light on ";
 			ft->setLight(true);
@@ -146,6 +402,160 @@ int main(int argc, char *argv[])
 			time = ft->getFlashTime();
 			ft->isOkay ? cout << "successful. Time is " << time : cout << "failed";
 			break;
+
+		case FT_CMD_STROBE_RUN:
+			cout << "Strobing ";
+			if (ft->setStrobe(strobeHz, strobeDuty, strobePulses)) {
+				ft->startStrobe(strobeDelay >= 0, strobeDelay >= 0 ? strobeDelay : 0);
+			}
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case ACTION_STROBE_STOP:
+			cout << "Stopping strobe ";
+			ft->stopStrobe();
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case FT_CMD_LIGHT_LEAD_SET:
+			cout << "Setting light lead" << endl;
+			ft->setLightLead(leadMs, tailMs);
+			ft->isOkay ? cout << "successful. Lead is " << leadMs << ", tail is " << tailMs : cout << "failed";
+			break;
+
+		case FT_CMD_FLASH_TIME_US_SET:
+			cout << "Setting flash time in microseconds" << endl;
+			ft->setFlashTimeUs(timeUs);
+			ft->isOkay ? cout << "successful. Time is " << timeUs : cout << "failed";
+			break;
+
+		case FT_CMD_FLASH_TIME_US_GET:
+			cout << "Fetching flash time in microseconds" << endl;
+			timeUs = ft->getFlashTimeUs();
+			ft->isOkay ? cout << "successful. Time is " << timeUs : cout << "failed";
+			break;
+
+		case FT_CMD_CHANNEL_ON:
+			cout << "Turning channels on ";
+			ft->channelsOn(channelMask);
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case FT_CMD_CHANNEL_OFF:
+			cout << "Turning channels off ";
+			ft->channelsOff(channelMask);
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case FT_CMD_CHANNEL_PULSE:
+			cout << "Pulsing channels ";
+			ft->channelsPulse(channelMask);
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case FT_CMD_CHANNEL_TIME_SET:
+			cout << "Setting channel time" << endl;
+			ft->setChannelTime(channel, channelTime);
+			ft->isOkay ? cout << "successful. Time of channel " << channel << " is " << channelTime : cout << "failed";
+			break;
+
+		case FT_CMD_CHANNEL_GET:
+			cout << "Fetching channel state ";
+			channelMask = ft->channelState();
+			ft->isOkay ? cout << "successful. Active channels are 0x" << hex << channelMask << dec : cout << "failed";
+			break;
+
+		case FT_CMD_EXT_ARM:
+			if (extFlags) {
+				cout << "Arming external trigger ";
+				ft->extTriggerArm(extFlags, extDebounce);
+			} else {
+				cout << "Disarming external trigger ";
+				ft->extTriggerDisarm();
+			}
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case ACTION_WAIT_EVENTS:
+			cout << "Waiting for " << extEvents << " external trigger events" << endl;
+			while (extEvents > 0) {
+				if (ft->readEvent(&extEvent, 1000)) {
+					cout << "event " << (int)extEvent.count << " at device time " << extEvent.deviceTime
+						<< ", fired after " << extEvent.fireUs << "us" << endl;
+					extEvents--;
+				} else if (!ft->isOkay) {
+					cout << "failed";
+					break;
+				}
+			}
+			break;
+
+		case FT_CMD_LAG_SETUP:
+			cout << "Setting up shutter lag measurement ";
+			ft->setupShutterLag(lagEdge != "off", lagEdge == "rising");
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
+
+		case FT_CMD_LAG_GET:
+			cout << "Fetching shutter lag" << endl;
+			lag = ft->shutterLag();
+			ft->isOkay ? cout << "successful. " << lag.samples << " shots, min " << lag.minUs
+				<< "us, median " << lag.medianUs << "us, max " << lag.maxUs
+				<< "us, mean " << lag.meanUs << "us" : cout << "failed";
+			break;
+
+		case FT_CMD_STATUS:
+			cout << "Fetching status" << endl;
+			status = ft->status();
+			ft->isOkay ? cout << "successful. Version " << (int)status.version
+				<< ", active channels 0x" << hex << (int)status.channels
+				<< ", flags 0x" << (int)status.flags << dec
+				<< ", flash time " << status.flashTimeUs << "us"
+				<< ", " << status.flashLeftUs << "us left"
+				<< ", sequence state " << (int)status.seqState
+				<< ", event " << (int)status.seqIndex
+				<< ", runs " << status.seqRuns
+				<< ", device time " << status.deviceTime : cout << "failed";
+			break;
+
+		case FT_CMD_TRACE_GET:
+			cout << "Fetching trace" << endl;
+			traceEntries = ft->readTrace();
+			if (!ft->isOkay) {
+				cout << "failed";
+				break;
+			}
+			PrintTrace(traceEntries);
+			counters = ft->counters();
+			ft->resetTrace();
+			ft->isOkay ? cout << "successful. " << counters.commands << " commands, "
+				<< counters.flashRestarts << " flash restarts, max timer interrupt latency "
+				<< counters.maxIsrLatencyTicks * 1000.0 / FT_TIMER_TICKS_PER_MS << "us" : cout << "failed";
+			break;
+
+		case FT_CMD_CLOCK_GET:
+			cout << "Fetching clock calibration" << endl;
+			clock = ft->clockCalibration();
+			ft->isOkay ? (clock.windows ? cout << "successful. Correction " << clock.correctionPpm << "ppm"
+				<< ", last window " << clock.lastPpm << "ppm"
+				<< ", " << clock.windows << " windows measured"
+				: cout << "successful. Not calibrated, no usb frames seen (INT0 has to be wired to D-)") : cout << "failed";
+			break;
+
+		case FT_CMD_SEQ_STATUS:
+			cout << "Fetching sequence status" << endl;
+			seqStatus = ft->sequenceStatus();
+			ft->isOkay ? cout << "successful. State is " << (int)seqStatus.state
+				<< ", event " << (int)seqStatus.index
+				<< ", runs " << seqStatus.runs
+				<< ", " << seqStatus.elapsedMs << "ms into the run" : cout << "failed";
+			break;
+
+		case FT_CMD_SEQ_ABORT:
+			cout << "Aborting sequence ";
+			ft->abortSequence();
+			ft->isOkay ? cout << "successful" : cout << "failed";
+			break;
 	}
 	cout << endl;
 	return 0;
@@ -9,6 +9,240 @@
 #define FT_CMD_LIGHT_STATE		 ((unsigned char) 0x05)
 #define FT_CMD_FLASH_TIME_SET    ((unsigned char) 0x06)
 #define FT_CMD_FLASH_TIME_GET    ((unsigned char) 0x07)
+/* 32 bit flash time in microseconds, wValue holds the lower, wIndex the upper 16 bit */
+#define FT_CMD_FLASH_TIME_US_SET ((unsigned char) 0x08)
+#define FT_CMD_FLASH_TIME_US_GET ((unsigned char) 0x09)
+/* sequences of timed events, played by the controller on its own */
+#define FT_CMD_SEQ_UPLOAD        ((unsigned char) 0x0A) /* data stage holds events, wValue is the first event index */
+#define FT_CMD_SEQ_START         ((unsigned char) 0x0B) /* wValue is the number of runs, 0 repeats until aborted */
+#define FT_CMD_SEQ_ABORT         ((unsigned char) 0x0C)
+#define FT_CMD_SEQ_STATUS        ((unsigned char) 0x0D) /* returns state, event index, runs (16 bit), ms into the run (32 bit) */
+/* two phase shot: arm preloads the whole shot, fire executes it without any parsing */
+#define FT_CMD_ARM               ((unsigned char) 0x0E) /* data stage holds FT_ARM_SIZE bytes */
+#define FT_CMD_FIRE              ((unsigned char) 0x0F)
+/* usb frame synchronized firing of the armed shot, needs INT0 wired to D- */
+#define FT_CMD_FRAME_FIRE        ((unsigned char) 0x10) /* wValue is the frame number to fire at */
+#define FT_CMD_FRAME_GET         ((unsigned char) 0x11) /* returns frame (16 bit), FT_FRAME_* state, target frame (16 bit), timer ticks from the frame start, as stamped by the usb interrupt, to the edge of the outputs (16 bit) */
+/* device time in timer ticks (32 bit), latched when a command is processed */
+#define FT_CMD_TIMESTAMP_GET     ((unsigned char) 0x12) /* returns the time of the previous command and of this one */
+/* output channels, wValue is a mask of FT_CH_* */
+#define FT_CMD_CHANNEL_ON        ((unsigned char) 0x13)
+#define FT_CMD_CHANNEL_OFF       ((unsigned char) 0x14)
+#define FT_CMD_CHANNEL_PULSE     ((unsigned char) 0x15) /* each channel for its own time, the flash for the flash time */
+#define FT_CMD_CHANNEL_TIME_SET  ((unsigned char) 0x16) /* wValue is the time in ms, wIndex the channel number */
+#define FT_CMD_CHANNEL_GET       ((unsigned char) 0x17) /* returns the mask of active channels and the times of all channels (16 bit each) */
+/* external trigger input on INT1 (PD3), an edge fires the armed shot on the device, or flash and trigger if none is armed */
+#define FT_CMD_EXT_ARM           ((unsigned char) 0x18) /* wValue is a mask of FT_EXT_*, wIndex the debounce time in ms */
+#define FT_CMD_EXT_STATUS        ((unsigned char) 0x19) /* returns FT_EXT_* flags, debounce (16 bit) and the last event report */
+/* camera half press, to wake it up and focus ahead of the shot */
+#define FT_CMD_PREFOCUS          ((unsigned char) 0x1A) /* wValue is the hold time in ms, 0 uses the focus channel time */
+#define FT_CMD_FOCUS_FIRE        ((unsigned char) 0x1B) /* focuses, fires the armed shot after wValue ms */
+/* light lead for flash and trigger, the lamp is switched on ahead of the trigger */
+#define FT_CMD_LIGHT_LEAD_SET    ((unsigned char) 0x1E) /* wValue is the lead in ms, wIndex the time the light stays on after the trigger in ms, 0 uses the flash time */
+#define FT_CMD_LIGHT_LEAD_GET    ((unsigned char) 0x1F) /* returns lead and tail (16 bit each) */
+/* strobe, the light pulsed by the compare output of the timer */
+#define FT_CMD_STROBE_SET        ((unsigned char) 0x20) /* data stage holds FT_STROBE_SIZE bytes */
+#define FT_CMD_STROBE_RUN        ((unsigned char) 0x21) /* wValue is a mask of FT_STROBE_*, 0 stops, wIndex the delay from the trigger to the first pulse in ms */
+/* all state of the controller in one transfer, see FT_STATUS_SIZE */
+#define FT_CMD_STATUS            ((unsigned char) 0x22)
+/* trace of the controller, for a timeline of what it did */
+#define FT_CMD_TRACE_GET         ((unsigned char) 0x23) /* stops recording, returns next entry index, wrapped flag and FT_TRACE_ENTRIES entries */
+#define FT_CMD_TRACE_RESET       ((unsigned char) 0x24) /* clears trace and counters, restarts recording */
+#define FT_CMD_COUNTERS_GET      ((unsigned char) 0x25) /* returns commands processed, flash restarts and the max timer ISR latency in ticks (16 bit each) */
+/* calibration of the 1ms tick and the flash timer against the usb frames */
+#define FT_CMD_CLOCK_GET         ((unsigned char) 0x26) /* returns FT_CLOCK_SIZE bytes */
+/* shutter lag, from the trigger edge to the flash sync of the camera on AIN1 (PD7) */
+#define FT_CMD_LAG_SETUP         ((unsigned char) 0x1C) /* wValue is a mask of FT_LAG_*, clears the measurements */
+#define FT_CMD_LAG_GET           ((unsigned char) 0x1D) /* returns the number of measured shots (1 byte, wraps) and the last FT_LAG_SAMPLES lags in timer ticks (32 bit each, 0 if unused), oldest first */
+
+/* protocol table, X(command, request type, value encoding, length) for all */
+/* commands. The length is the data stage of FT_REQ_OUT commands or the reply */
+/* of FT_REQ_IN ones, FT_LEN_VAR if it varies. Firmware, kernel module and */
+/* host library expand it into their tables, see FT_PROTOCOL_LENGTHS. */
+#define FT_REQ_OUT               0x40 /* vendor request to the device, host to device */
+#define FT_REQ_IN                0xC0 /* vendor request to the device, device to host */
+#define FT_VAL_NONE              0    /* wValue and wIndex are 0 */
+#define FT_VAL_16                1    /* wValue, wIndex is 0 */
+#define FT_VAL_32                2    /* the lower 16 bit in wValue, the upper ones in wIndex */
+#define FT_LEN_VAR               0xFFFF
+
+#define FT_PROTOCOL(X) \
+	X(FT_CMD_TRIGGER,          FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_FLASH_AND_TRIGGER, FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_LIGHT_ON,         FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_LIGHT_OFF,        FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_LIGHT_STATE,      FT_REQ_IN,  FT_VAL_NONE, 1) \
+	X(FT_CMD_FLASH_TIME_SET,   FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_FLASH_TIME_GET,   FT_REQ_IN,  FT_VAL_NONE, 2) \
+	X(FT_CMD_FLASH_TIME_US_SET, FT_REQ_OUT, FT_VAL_32,  0) \
+	X(FT_CMD_FLASH_TIME_US_GET, FT_REQ_IN, FT_VAL_NONE, 4) \
+	X(FT_CMD_SEQ_UPLOAD,       FT_REQ_OUT, FT_VAL_16,   FT_LEN_VAR) \
+	X(FT_CMD_SEQ_START,        FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_SEQ_ABORT,        FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_SEQ_STATUS,       FT_REQ_IN,  FT_VAL_NONE, 8) \
+	X(FT_CMD_ARM,              FT_REQ_OUT, FT_VAL_NONE, FT_ARM_SIZE) \
+	X(FT_CMD_FIRE,             FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_FRAME_FIRE,       FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_FRAME_GET,        FT_REQ_IN,  FT_VAL_NONE, 7) \
+	X(FT_CMD_TIMESTAMP_GET,    FT_REQ_IN,  FT_VAL_NONE, 8) \
+	X(FT_CMD_CHANNEL_ON,       FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_CHANNEL_OFF,      FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_CHANNEL_PULSE,    FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_CHANNEL_TIME_SET, FT_REQ_OUT, FT_VAL_32,   0) \
+	X(FT_CMD_CHANNEL_GET,      FT_REQ_IN,  FT_VAL_NONE, 1 + 2 * FT_CHANNELS) \
+	X(FT_CMD_EXT_ARM,          FT_REQ_OUT, FT_VAL_32,   0) \
+	X(FT_CMD_EXT_STATUS,       FT_REQ_IN,  FT_VAL_NONE, 3 + FT_EVENT_SIZE) \
+	X(FT_CMD_PREFOCUS,         FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_FOCUS_FIRE,       FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_LAG_SETUP,        FT_REQ_OUT, FT_VAL_16,   0) \
+	X(FT_CMD_LAG_GET,          FT_REQ_IN,  FT_VAL_NONE, 1 + 4 * FT_LAG_SAMPLES) \
+	X(FT_CMD_LIGHT_LEAD_SET,   FT_REQ_OUT, FT_VAL_32,   0) \
+	X(FT_CMD_LIGHT_LEAD_GET,   FT_REQ_IN,  FT_VAL_NONE, 4) \
+	X(FT_CMD_STROBE_SET,       FT_REQ_OUT, FT_VAL_NONE, FT_STROBE_SIZE) \
+	X(FT_CMD_STROBE_RUN,       FT_REQ_OUT, FT_VAL_32,   0) \
+	X(FT_CMD_STATUS,           FT_REQ_IN,  FT_VAL_NONE, FT_STATUS_SIZE) \
+	X(FT_CMD_TRACE_GET,        FT_REQ_IN,  FT_VAL_NONE, FT_TRACE_HEADER + FT_TRACE_ENTRIES * FT_TRACE_ENTRY_SIZE) \
+	X(FT_CMD_TRACE_RESET,      FT_REQ_OUT, FT_VAL_NONE, 0) \
+	X(FT_CMD_COUNTERS_GET,     FT_REQ_IN,  FT_VAL_NONE, 6) \
+	X(FT_CMD_CLOCK_GET,        FT_REQ_IN,  FT_VAL_NONE, FT_CLOCK_SIZE)
+
+/* FT_CMD_<name>_LEN, the length of each command as constant */
+#define FT_PROTOCOL_LENGTH(command, type, value, length) command##_LEN = (length),
+#define FT_PROTOCOL_LENGTHS enum { FT_PROTOCOL(FT_PROTOCOL_LENGTH) }
+
+
+/* sequence event layout: action (1 byte), offset in ms from the start of */
+/* the run (4 bytes), parameter (4 bytes), multi byte values MSB first */
+#define FT_SEQ_EVENT_SIZE        9
+#define FT_SEQ_MAX_EVENTS        24
+
+/* sequence event actions */
+#define FT_SEQ_END               0x00 /* its offset is the period of repeated runs */
+#define FT_SEQ_TRIGGER           0x01
+#define FT_SEQ_LIGHT_ON          0x02
+#define FT_SEQ_LIGHT_OFF         0x03
+#define FT_SEQ_FLASH             0x04 /* parameter is the flash time in us, 0 uses the set one */
+#define FT_SEQ_FLASH_AND_TRIGGER 0x05 /* parameter as for FT_SEQ_FLASH */
+#define FT_SEQ_CHANNEL_ON        0x06 /* parameter is a mask of FT_CH_* */
+#define FT_SEQ_CHANNEL_OFF       0x07
+#define FT_SEQ_CHANNEL_PULSE     0x08
+
+/* armed shot layout: flash time in us (4 bytes), light lead before the */
+/* trigger in ms (2 bytes), trigger pulse in ms (1 byte, 0 uses the default), */
+/* output channels (1 byte), multi byte values MSB first */
+#define FT_ARM_SIZE              8
+
+/* strobe layout: period in us (4 bytes), on time in us (4 bytes), number */
+/* of pulses (2 bytes, 0 pulses until stopped), multi byte values MSB first */
+#define FT_STROBE_SIZE           10
+
+/* strobe flags */
+#define FT_STROBE_RUN            0x01
+#define FT_STROBE_WITH_TRIGGER   0x02 /* holds the trigger from before the first to after the last pulse */
+
+/* status layout: version (1 byte), size (1 byte), active channels (1 byte), */
+/* FT_STATUS_* flags (1 byte), flash time in us (4 bytes), flash time left in */
+/* us (4 bytes), sequence state, event index (1 byte each), runs (2 bytes), */
+/* device time of the request (4 bytes), multi byte values MSB first. Later */
+/* versions only append fields, hosts ask for the size they know. */
+#define FT_STATUS_VERSION        1
+#define FT_STATUS_SIZE           20
+
+/* status flags */
+#define FT_STATUS_ARMED          0x01
+#define FT_STATUS_STROBE         0x02
+#define FT_STATUS_EXT_ARMED      0x04
+#define FT_STATUS_FRAME_PENDING  0x08
+#define FT_STATUS_LAG_WAITING    0x10
+#define FT_STATUS_LEAD_PENDING   0x20 /* a light lead runs, light and trigger switch on the next ticks */
+#define FT_STATUS_FOCUS_PENDING  0x40 /* the shot follows a half press */
+
+/* clock layout: applied correction, last measured correction (signed 32 */
+/* bit each, in 1/FT_CLOCK_SCALE of the timer rate, positive if the timer */
+/* runs fast), measured windows of FT_CLOCK_WINDOW frames (2 bytes), multi */
+/* byte values MSB first. The frames are only seen with INT0 wired to D-. */
+#define FT_CLOCK_SIZE            10
+#define FT_CLOCK_SCALE           16777216L
+#define FT_CLOCK_WINDOW          1024
+
+/* trace entry layout: FT_TRACE_* type (1 byte), argument (1 byte), device */
+/* time (4 bytes, MSB first). The ring holds the last FT_TRACE_ENTRIES. */
+#define FT_TRACE_HEADER          2
+#define FT_TRACE_ENTRY_SIZE      6
+#define FT_TRACE_ENTRIES         32
+
+/* trace entry types */
+#define FT_TRACE_CMD             0x01 /* argument is the command */
+#define FT_TRACE_ON              0x02 /* argument is a mask of FT_CH_* */
+#define FT_TRACE_OFF             0x03
+#define FT_TRACE_SEQ             0x04 /* argument is the FT_SEQ_* action */
+#define FT_TRACE_FRAME           0x05 /* argument is the low byte of the frame */
+#define FT_TRACE_EXT             0x06 /* argument is the event counter */
+#define FT_TRACE_SYNC            0x07 /* argument is the shutter lag counter */
+#define FT_TRACE_STROBE          0x08 /* argument is 1 for start, 0 for end */
+
+/* external trigger flags */
+#define FT_EXT_ENABLE            0x01
+#define FT_EXT_RISING            0x02 /* fire on the rising edge, else on the falling one */
+#define FT_EXT_REARM             0x04 /* stay armed after an event, else fire once */
+#define FT_EXT_PULLUP            0x08 /* for open collector sources like light barriers */
+
+/* shutter lag flags */
+#define FT_LAG_ENABLE            0x01
+#define FT_LAG_RISING            0x02 /* the sync signal rises, else it is pulled low like a hot shoe contact */
+
+/* shutter lag measurements kept by the device */
+#define FT_LAG_SAMPLES           8
+
+/* event reports on the interrupt in endpoint: type (1 byte), event counter */
+/* (1 byte), device time of the edge (4 bytes), timer ticks from the edge to */
+/* the fired outputs (2 bytes), multi byte values MSB first */
+#define FT_EVENT_ENDPOINT        0x81
+#define FT_EVENT_SIZE            8
+#define FT_EVENT_EXT_TRIGGER     0x01
+
+/* commands on the interrupt out endpoint: type (1 byte), command, wValue */
+/* and wIndex (2 bytes each, LSB first as in a setup packet). Only for the */
+/* commands without a data stage, replies are dropped. */
+#define FT_OUT_ENDPOINT          0x01
+#define FT_OUT_SIZE              6
+#define FT_OUT_COMMAND           0x01
+
+/* HID reports without report id, for hidraw: the output report is the */
+/* command packet of the interrupt out endpoint, the input report the event */
+/* report. A feature report set with a command packet, followed by the data */
+/* stage of the command, runs it. The feature report read next returns its */
+/* reply. */
+#define FT_HID_FEATURE_SIZE      254
+
+/* output channels, bit n of a mask is channel number n */
+#define FT_CH_TRIGGER            0x01
+#define FT_CH_FLASH              0x02
+#define FT_CH_AUX0               0x04
+#define FT_CH_AUX1               0x08
+#define FT_CH_AUX2               0x10
+#define FT_CH_AUX_MASK           (FT_CH_AUX0 | FT_CH_AUX1 | FT_CH_AUX2)
+#define FT_CH_FOCUS              0x20 /* half press of the camera remote */
+#define FT_CH_NUM_TRIGGER        0
+#define FT_CH_NUM_FLASH          1
+#define FT_CH_NUM_FOCUS          5
+#define FT_CHANNELS              6
+
+/* frame fire states */
+#define FT_FRAME_IDLE            0x00
+#define FT_FRAME_PENDING         0x01
+#define FT_FRAME_FIRED           0x02
+#define FT_FRAME_MISSED          0x03
+
+/* sequence states */
+#define FT_SEQ_STATE_IDLE        0x00
+#define FT_SEQ_STATE_RUNNING     0x01
+#define FT_SEQ_STATE_DONE        0x02
+#define FT_SEQ_STATE_ABORTED     0x03
+
+
+/* the controller timer counts F_CPU / 8, with its 12 MHz crystal */
+#define FT_TIMER_TICKS_PER_MS    1500
 
 
 /* host side /dev/<NAME> creation */
@@ -24,16 +258,26 @@
 
 
 
-/* the hardware ports on the controller for flash and trigger */
+/* the hardware ports on the controller for flash and trigger, which must share */
+/* a port with the focus line: the armed shot switches them in one write */
 #define PORT_TRIGGER B
 #define PIN_TRIGGER  3
 
 #define PORT_FLASH B
 #define PIN_FLASH  2
 
+/* the focus (half press) line of the camera remote */
+#define PORT_FOCUS B
+#define PIN_FOCUS  4
+
+/* the auxiliary outputs FT_CH_AUX0..2, on three consecutive pins from PIN_AUX0 */
+#define PORT_AUX C
+#define PIN_AUX0   0
+
 
 
-/* if the flash and/or trigger output are active at low level,
- uncomment the following two lines */
+/* if the flash, trigger and/or focus output are active at low level,
+ uncomment the following lines */
 // #define TRIGGER_ACTIVE_IS_LOW
-// #define FLASH_ACTIVE_IS_LOW
\ No newline at end of file
+// #define FLASH_ACTIVE_IS_LOW
+// #define FOCUS_ACTIVE_IS_LOW
\ No newline at end of file
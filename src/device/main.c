@@ -17,6 +17,9 @@
 
 #include "../common/defines.h"
 
+/* the reply and data stage lengths, FT_CMD_<name>_LEN */
+FT_PROTOCOL_LENGTHS;
+
 
 
 
@@ -37,6 +40,14 @@
 #define FLASHPORT 	PORTOF(PORT_FLASH)
 #define FLASHDDR 	DDROF(PORT_FLASH)
 #define FLASHPIN 	PINOF(PORT_FLASH, PIN_FLASH)
+#define FOCUSPORT 	PORTOF(PORT_FOCUS)
+#define FOCUSDDR 	DDROF(PORT_FOCUS)
+#define FOCUSPIN 	PINOF(PORT_FOCUS, PIN_FOCUS)
+#define AUXPORT 	PORTOF(PORT_AUX)
+#define AUXDDR 		DDROF(PORT_AUX)
+
+// the aux channels of a channel mask, moved to their pins
+#define AUX_BITS(mask)	((((mask) & FT_CH_AUX_MASK) >> 2) << PIN_AUX0)
 
 
 #ifdef TRIGGER_ACTIVE_IS_LOW
@@ -59,39 +70,1115 @@
 	#define FLASH_STATE  FLASHPORT & (1 << FLASHPIN)
 #endif
 
+// compare output modes of OC1B, the flash pin, for the strobe
+#define STROBE_SET_MODE		((1 << COM1B1) | (1 << COM1B0))
+#define STROBE_CLEAR_MODE	(1 << COM1B1)
+#ifdef FLASH_ACTIVE_IS_LOW
+	#define STROBE_ON_MODE	STROBE_CLEAR_MODE
+	#define STROBE_OFF_MODE	STROBE_SET_MODE
+#else
+	#define STROBE_ON_MODE	STROBE_SET_MODE
+	#define STROBE_OFF_MODE	STROBE_CLEAR_MODE
+#endif
+
+#ifdef FOCUS_ACTIVE_IS_LOW
+	#define SET_FOCUS 	 FOCUSPORT	 &= ~(1 << FOCUSPIN);
+	#define STOP_FOCUS 	 FOCUSPORT	 |= (1 << FOCUSPIN);
+#else
+	#define SET_FOCUS 	 FOCUSPORT	 |= (1 << FOCUSPIN);
+	#define STOP_FOCUS 	 FOCUSPORT	 &= ~(1 << FOCUSPIN);
+#endif
+
+
+
+
+// Timer1 runs freely with the prescaler set to 8, giving it 1.5 MHz
+#define START_TIMER TCCR1B = (0 << CS12) | (1 << CS11) | (0 << CS10);
+#define US_TO_TICKS(us) ((uint32_t)(us) * (F_CPU / 1000000UL) / 8)
+#define TICKS_TO_US(ticks) ((uint32_t)(ticks) * 8 / (F_CPU / 1000000UL))
+
+// the flash timer counts down in chunks that fit the 16 bit compare register
+#define FLASH_CHUNK_US	32768UL
+// shortest compare distance, that is safely ahead of TCNT1 when it is set
+#define FLASH_MIN_TICKS	8
 
+// the strobe schedules its phases in chunks of at most this many ticks
+#define STROBE_CHUNK_TICKS	32768UL
+// shortest strobe phase, the compare ISR must be able to set up the next edge in time
+#define STROBE_MIN_TICKS	300
 
+// the compare A unit gives the 1ms system tick
+#define TICKS_PER_MS	(F_CPU / 8000UL)
 
-// Timer is enable by setting the prescaler to 8, giving it 1.5 MHz
-#define ENABLE_TIMER TCCR1B |=(0 << CS12) | (1 << CS11) | (0 << CS10);
-// likewise it is disabled by setting the prescaler to 0
-#define STOP_TIMER	TCCR1B &= ~(0x07);
+// length of the trigger pulse to the camera
+#define TRIGGER_PULSE_MS 30
 
+// a flash sync later than this after the trigger is not taken as its shutter lag
+#define LAG_TIMEOUT_MS	2000
 
+// give up waiting for a frame start after this, e.g. on a suspended bus
+#define FRAME_WAIT_TICKS (2 * TICKS_PER_MS)
+
+// a frame stamp further off than this from the expected one means a missed frame
+#define CLOCK_MAX_STEP_TICKS	8
+// largest correction taken from a window, about 1950 ppm of the timer rate
+#define CLOCK_MAX_CORR	32767
 
 
 
 uint8_t lightIsOn = 0;
-uint16_t flashTime = 500;
-uint16_t flashTimeLeft;
+uint32_t flashTimeUs = 500000;
+volatile uint32_t flashTimeUsLeft;
+
+/* per channel timers, counted down by the 1ms tick, the flash has its own timer */
+volatile uint16_t channelMsLeft[FT_CHANNELS];
+uint16_t channelTime[FT_CHANNELS] = { TRIGGER_PULSE_MS, 0, 1000, 1000, 1000, 1000 };
+
+/* the sequence table is kept as received, see FT_SEQ_EVENT_SIZE for the layout */
+uint8_t seqTable[FT_SEQ_MAX_EVENTS * FT_SEQ_EVENT_SIZE];
+volatile uint8_t seqState = FT_SEQ_STATE_IDLE;
+volatile uint8_t seqIndex;
+volatile uint16_t seqRuns;
+uint16_t seqRunsLeft;
+volatile uint32_t seqMs;
+
+/* the armed shot, prepared by FT_CMD_ARM so that FT_CMD_FIRE has nothing to compute */
+uint8_t armData[FT_ARM_SIZE];
+uint8_t armed = 0;
+uint8_t armChannels;
+uint16_t armLeadMs;
+uint8_t armPulseMs;
+uint16_t armFlashTicks;
+uint32_t armFlashUs;
+uint32_t armFlashUsLeft;
+uint8_t armLead;			// trigger and flash go through the light lead
+uint8_t armNow;				// channels switched by fire() itself
+uint8_t armPortSet;			// trigger, flash and focus port bits, written in one go
+uint8_t armPortClear;
+uint8_t armAuxSet;
+
+/* focus then fire: the armed shot follows the half press after focusFireMsLeft */
+volatile uint16_t focusFireMsLeft;
+
+/* shutter lag, captured by Timer1 from the analog comparator */
+uint32_t lagTriggerTime;
+volatile uint16_t lagMsLeft;
+uint32_t lagTicks[FT_LAG_SAMPLES];
+uint8_t lagCount;
+
+/* strobe: OC1B switches the light in hardware, the compare B ISR only schedules the edges */
+uint8_t strobeData[FT_STROBE_SIZE];
+uint32_t strobeOnTicks;
+uint32_t strobeOffTicks;
+uint16_t strobePulses;
+volatile uint8_t strobeActive;
+uint8_t strobeOn;
+uint8_t strobeWithTrigger;
+uint16_t strobePulsesLeft;
+uint32_t strobeTicksLeft;
+volatile uint16_t strobeDelayMsLeft;
+
+/* light lead: the trigger follows the light after leadMsLeft */
+volatile uint16_t leadMsLeft;
+uint8_t leadPulseMs;
+volatile uint8_t leadFlashPending;
+uint32_t leadFlashUs;
+uint16_t lightLeadMs;
+uint16_t lightTailMs;
+
+/* free running device time, Timer1 extended to 32 bit: the device time of */
+/* the last tick compare, the tick carries the wraps of TCNT1 */
+volatile uint32_t tickTime;
+uint32_t cmdTimestamp;
+uint32_t prevCmdTimestamp;
+
+/* usb frame counter, extended from the 8 bit usbSofCount by the tick */
+volatile uint16_t frameCount;
+volatile uint8_t frameSofSeen;
+uint8_t frameState = FT_FRAME_IDLE;
+uint16_t frameTarget;
+uint16_t frameFireTicks;
+uint8_t fireStamp;	// TCNT0 at the edge of the last switchOn(), against sofStamp
+
+/* calibration of the timer against the usb frames, in 1/FT_CLOCK_SCALE */
+volatile uint8_t sofStamp; // TCNT0 at the last frame start, set by USB_SOF_HOOK
+uint8_t clockSofSeen;
+uint8_t clockStampSeen;
+uint8_t clockIdleMs;
+int16_t clockErrTicks;
+uint16_t clockFrames;
+int16_t clockCorr;
+int16_t clockMeasured;
+uint16_t clockWindows;
+// ticks of the 1ms tick in 16.16 fixed point, the fraction is carried on
+uint32_t tickStep = (uint32_t)TICKS_PER_MS << 16;
+uint16_t tickFraction;
+
+/* external trigger on INT1, its events are reported on the interrupt endpoint */
+uint8_t extFlags;
+uint16_t extDebounceMs;
+volatile uint16_t extHoldMsLeft;
+uint8_t extEvent[FT_EVENT_SIZE] = { FT_EVENT_EXT_TRIGGER };
+volatile uint8_t extEventPending;
+
+/* trace of commands, outputs and timer events: next entry, wrapped flag and */
+/* the ring of entries, sent as it is by FT_CMD_TRACE_GET */
+uint8_t traceBuffer[FT_CMD_TRACE_GET_LEN];
+volatile uint8_t traceFrozen;
+
+/* performance counters */
+uint16_t cmdCount;
+uint16_t flashRestarts;
+uint16_t maxIsrLatency;
+
+/* target of control-out data stages, filled by usbFunctionWrite */
+uint8_t *writePtr;
+uint8_t writeLeft;
+uint8_t writeCmd;
+// writeCmd of the command packet that starts a hid feature report
+#define WRITE_HID_REPORT	0
+
+/* command of the last hid feature report and its reply */
+uint8_t hidPacket[FT_OUT_SIZE];
+uint8_t hidDataLen;
+uchar *hidReplyPtr;
+uint8_t hidReplyLen;
+
+/* last data token on the interrupt out endpoint, a repeated one is a duplicate */
+uchar outToken;
+
+/* vendor defined hid reports for hidraw, see FT_HID_FEATURE_SIZE */
+PROGMEM const uint8_t usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] = {
+	0x06, 0x00, 0xff,	/* usage page (vendor defined) */
+	0x09, 0x01,			/* usage (vendor usage 1) */
+	0xa1, 0x01,			/* collection (application) */
+	0x15, 0x00,			/*   logical minimum (0) */
+	0x26, 0xff, 0x00,	/*   logical maximum (255) */
+	0x75, 0x08,			/*   report size (8) */
+	0x95, FT_EVENT_SIZE, /*   report count, the event report */
+	0x09, 0x02,			/*   usage (vendor usage 2) */
+	0x81, 0x02,			/*   input (data, variable, absolute) */
+	0x95, FT_OUT_SIZE,	/*   report count, the command packet */
+	0x09, 0x03,			/*   usage (vendor usage 3) */
+	0x91, 0x02,			/*   output (data, variable, absolute) */
+	0x95, FT_HID_FEATURE_SIZE, /* report count, command with data or reply */
+	0x09, 0x04,			/*   usage (vendor usage 4) */
+	0xb1, 0x02,			/*   feature (data, variable, absolute) */
+	0xc0				/* end collection */
+};
+
+/* the configuration of the driver, with the interrupt out endpoint for commands */
+PROGMEM const char usbDescriptorConfiguration[] = {
+	9,					/* length of the configuration descriptor */
+	USBDESCR_CONFIG,
+	41, 0,				/* total length, including the descriptors below */
+	1,					/* interfaces */
+	1,					/* index of this configuration */
+	0,					/* configuration name string index */
+	(1 << 7),			/* attributes, bus powered */
+	USB_CFG_MAX_BUS_POWER / 2,
+	9,					/* length of the interface descriptor */
+	USBDESCR_INTERFACE,
+	0,					/* index of this interface */
+	0,					/* alternate setting */
+	2,					/* endpoints excluding 0 */
+	USB_CFG_INTERFACE_CLASS,
+	USB_CFG_INTERFACE_SUBCLASS,
+	USB_CFG_INTERFACE_PROTOCOL,
+	0,					/* interface name string index */
+	9,					/* length of the hid descriptor, at offset 18 for the driver */
+	USBDESCR_HID,
+	0x01, 0x01,			/* hid version 1.1 */
+	0x00,				/* country code */
+	0x01,				/* report descriptors */
+	USBDESCR_HID_REPORT,
+	USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+	7,					/* length of the endpoint descriptor */
+	USBDESCR_ENDPOINT,
+	(char)FT_EVENT_ENDPOINT, /* interrupt in for the event reports */
+	0x03,				/* interrupt endpoint */
+	8, 0,				/* maximum packet size */
+	USB_CFG_INTR_POLL_INTERVAL,
+	7,
+	USBDESCR_ENDPOINT,
+	FT_OUT_ENDPOINT,	/* interrupt out for the commands */
+	0x03,
+	8, 0,
+	1,					/* polled every frame, a command waits at most 1ms */
+};
+
+
+/* the device time in Timer1 ticks, wraps after 2^32 ticks */
+static uint32_t deviceTime(void) {
+	uint32_t base;
+	uint16_t low;
+
+	// the ticks since a compare, that the tick has not taken yet, are counted
+	// from the one before, so a read nested in the tick is right as well
+	cli();
+	base = tickTime;
+	low = TCNT1;
+	sei();
+	return base + (uint16_t)(low - (uint16_t)base);
+}
+
+static uint32_t readU32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint16_t)p[2] << 8) | p[3];
+}
+
+static void writeU32(uint8_t *p, uint32_t value) {
+	p[0] = (uint8_t)(value >> 24);
+	p[1] = (uint8_t)(value >> 16);
+	p[2] = (uint8_t)(value >> 8);
+	p[3] = (uint8_t)(value & 0xFF);
+}
+
+/* records an event with the device time, until the trace is read out */
+static void trace(uint8_t type, uint8_t arg) {
+	uint8_t *entry;
+	uint32_t now;
+
+	if (traceFrozen) {
+		return;
+	}
+	now = deviceTime();
+
+	// claim the entry, an interrupt may record another one meanwhile
+	cli();
+	entry = traceBuffer + FT_TRACE_HEADER + traceBuffer[0] * FT_TRACE_ENTRY_SIZE;
+	if (++traceBuffer[0] == FT_TRACE_ENTRIES) {
+		traceBuffer[0] = 0;
+		traceBuffer[1] = 1;
+	}
+	sei();
+
+	entry[0] = type;
+	entry[1] = arg;
+	writeU32(entry + 2, now);
+}
+
+/* converts us to timer ticks, corrected to the rate of the usb frames */
+static uint32_t usToTicks(uint32_t us) {
+	uint32_t ticks = US_TO_TICKS(us);
+	int16_t corr;
+
+	cli();
+	corr = clockCorr;
+	sei();
+
+	// in two halves, so that the products fit 32 bit
+	return ticks + (((int32_t)(ticks >> 16) * corr) >> 8)
+		+ (((int32_t)(ticks & 0xFFFF) * corr) >> 24);
+}
+
+/* takes the next chunk off usLeft and returns its length in ticks */
+static uint16_t flashTimerChunk(volatile uint32_t *usLeft) {
+	uint32_t us = *usLeft;
+	uint16_t ticks;
+
+	if (us > 2 * FLASH_CHUNK_US) {
+		us = FLASH_CHUNK_US;
+	} else if (us > FLASH_CHUNK_US) {
+		// split the rest evenly, so the last chunk is never too short
+		us >>= 1;
+	}
+	*usLeft -= us;
+
+	ticks = usToTicks(us);
+	if (ticks < FLASH_MIN_TICKS) {
+		ticks = FLASH_MIN_TICKS;
+	}
+	return ticks;
+}
+
+/* turns the light on, the flash timer fires after ticks and continues with usLeft */
+static void startFlashTimer(uint16_t ticks, uint32_t usLeft) {
+
+	// stop a flash or strobe that may still be running
+	cli();
+	if (TIMSK & (1 << OCIE1B)) {
+		flashRestarts++;
+	}
+	TIMSK &= ~(1 << OCIE1B);
+	TCCR1A = 0;
+	strobeActive = 0;
+	sei();
+
+	flashTimeUsLeft = usLeft;
+
+	// keep this short, the usb interrupt must not be blocked for long
+	cli();
+	SET_FLASH
+	OCR1B = TCNT1 + ticks;
+	TIFR = (1 << OCF1B);
+	TIMSK |= (1 << OCIE1B);
+	sei();
+	trace(FT_TRACE_ON, FT_CH_FLASH);
+}
+
+/* turns the light on and lets the flash timer turn it off after us microseconds */
+static void startFlash(uint32_t us) {
+	uint16_t ticks;
+
+	if (us == 0) {
+		return;
+	}
+
+	// the first chunk is taken off before the timer runs
+	ticks = flashTimerChunk(&us);
+	startFlashTimer(ticks, us);
+}
+
+/* turns the light off and stops a running flash timer */
+static void stopFlash(void) {
+	cli();
+	TIMSK &= ~(1 << OCIE1B);
+	// hands the pin back from the strobe to the port
+	TCCR1A = 0;
+	strobeActive = 0;
+	strobeDelayMsLeft = 0;
+	sei();
+	STOP_FLASH
+}
+
+/* the shutter lag is measured from the trigger edge at now, if lagSetup() enabled the capture */
+static void lagStart(uint32_t now) {
+	cli();
+	if (TIMSK & (1 << TICIE1)) {
+		lagTriggerTime = now;
+		lagMsLeft = LAG_TIMEOUT_MS;
+	}
+	sei();
+}
+
+static void startTrigger(uint16_t ms) {
+	uint32_t now = deviceTime();
+
+	cli();
+	channelMsLeft[FT_CH_NUM_TRIGGER] = ms;
+	SET_TRIGGER
+	sei();
+	lagStart(now);
+	trace(FT_TRACE_ON, FT_CH_TRIGGER);
+}
+
+/* the bits of TRIGGERPORT to set and to clear, that switch trigger, flash and focus of mask on */
+static void portBits(uint8_t mask, uint8_t *set, uint8_t *clear) {
+	*set = 0;
+	*clear = 0;
+	if (mask & FT_CH_TRIGGER) {
+		#ifdef TRIGGER_ACTIVE_IS_LOW
+			*clear |= (1 << TRIGGERPIN);
+		#else
+			*set |= (1 << TRIGGERPIN);
+		#endif
+	}
+	if (mask & FT_CH_FLASH) {
+		#ifdef FLASH_ACTIVE_IS_LOW
+			*clear |= (1 << FLASHPIN);
+		#else
+			*set |= (1 << FLASHPIN);
+		#endif
+	}
+	if (mask & FT_CH_FOCUS) {
+		#ifdef FOCUS_ACTIVE_IS_LOW
+			*clear |= (1 << FOCUSPIN);
+		#else
+			*set |= (1 << FOCUSPIN);
+		#endif
+	}
+}
+
+/*
+ * Switches the outputs in one write per port, in one cli section. With
+ * flashTicks the flash timer starts from that edge and continues with
+ * flashUsLeft, a flash or strobe still running is stopped. Returns the
+ * edge in TCNT1.
+ */
+static uint16_t switchOn(uint8_t portSet, uint8_t portClear, uint8_t auxSet, uint16_t flashTicks, uint32_t flashUsLeft) {
+	uint8_t restart;
+	uint16_t edge;
+
+	cli();
+	restart = TIMSK & (1 << OCIE1B);
+	if (flashTicks) {
+		// the pin goes back from the strobe to the port
+		TIMSK &= ~(1 << OCIE1B);
+		TCCR1A = 0;
+	}
+	TRIGGERPORT = (TRIGGERPORT & ~portClear) | portSet;
+	AUXPORT |= auxSet;
+	edge = TCNT1;
+	fireStamp = TCNT0;
+	if (flashTicks) {
+		OCR1B = edge + flashTicks;
+		TIFR = (1 << OCF1B);
+		TIMSK |= (1 << OCIE1B);
+		flashTimeUsLeft = flashUsLeft;
+		strobeActive = 0;
+	}
+	sei();
+
+	if (flashTicks && restart) {
+		flashRestarts++;
+	}
+	return edge;
+}
+
+/* switches all channels of mask on until switched off, in one write per port */
+static void channelsOn(uint8_t mask) {
+	uint8_t i, set, clear;
+
+	for (i = 0; i < FT_CHANNELS; i++) {
+		if (mask & (1 << i)) {
+			cli();
+			channelMsLeft[i] = 0;
+			sei();
+		}
+	}
+	portBits(mask, &set, &clear);
+	switchOn(set, clear, AUX_BITS(mask), 0, 0);
+	trace(FT_TRACE_ON, mask);
+}
+
+static void channelsOff(uint8_t mask) {
+	cli();
+	AUXPORT &= ~AUX_BITS(mask);
+	sei();
+	if (mask & FT_CH_TRIGGER) {
+		STOP_TRIGGER
+	}
+	if (mask & FT_CH_FOCUS) {
+		STOP_FOCUS
+	}
+	if (mask & FT_CH_FLASH) {
+		stopFlash();
+	}
+	trace(FT_TRACE_OFF, mask);
+}
+
+/* switches the channels of mask on, each for its own channelTime */
+static void channelsPulse(uint8_t mask) {
+	uint8_t i, set, clear;
+	uint32_t us = flashTimeUs;
+	uint16_t ticks = 0;
+
+	// the flash is switched with the others, its timer starts from the same edge
+	if (us == 0) {
+		mask &= ~FT_CH_FLASH;
+	} else if (mask & FT_CH_FLASH) {
+		ticks = flashTimerChunk(&us);
+	}
+	portBits(mask, &set, &clear);
+	switchOn(set, clear, AUX_BITS(mask), ticks, us);
+
+	for (i = 0; i < FT_CHANNELS; i++) {
+		if (i != FT_CH_NUM_FLASH && (mask & (1 << i))) {
+			cli();
+			channelMsLeft[i] = channelTime[i];
+			sei();
+		}
+	}
+	trace(FT_TRACE_ON, mask);
+}
+
+/* the channels that are currently on */
+static uint8_t channelsState(void) {
+	uint8_t mask = ((AUXPORT >> PIN_AUX0) << 2) & FT_CH_AUX_MASK;
+
+	if ((TRIGGERPORT & (1 << TRIGGERPIN)) != 0) {
+		mask |= FT_CH_TRIGGER;
+	}
+	if ((FLASHPORT & (1 << FLASHPIN)) != 0) {
+		mask |= FT_CH_FLASH;
+	}
+	if ((FOCUSPORT & (1 << FOCUSPIN)) != 0) {
+		mask |= FT_CH_FOCUS;
+	}
+	#ifdef TRIGGER_ACTIVE_IS_LOW
+		mask ^= FT_CH_TRIGGER;
+	#endif
+	#ifdef FLASH_ACTIVE_IS_LOW
+		mask ^= FT_CH_FLASH;
+	#endif
+	#ifdef FOCUS_ACTIVE_IS_LOW
+		mask ^= FT_CH_FOCUS;
+	#endif
+	return mask;
+}
+
+/*
+ * A light lead: the next tick switches the light on for us and the trigger
+ * for pulseMs follows exactly leadMs ticks later, for flashAndTrigger() and
+ * the armed shot alike.
+ */
+static void startLead(uint32_t us, uint8_t pulseMs, uint16_t leadMs) {
+	cli();
+	leadFlashUs = us;
+	leadPulseMs = pulseMs;
+	leadMsLeft = leadMs + 1;
+	leadFlashPending = 1;
+	sei();
+}
+
+/*
+ * Flashes for us and triggers the camera, with the light lead and tail if set.
+ * With a tail, the light is cut lightTailMs after the trigger instead of
+ * after us.
+ */
+static void flashAndTrigger(uint32_t us) {
+
+	if (lightTailMs) {
+		us = ((uint32_t)lightLeadMs + lightTailMs) * 1000;
+	}
+	if (lightLeadMs == 0) {
+		startFlash(us);
+		startTrigger(channelTime[FT_CH_NUM_TRIGGER]);
+		return;
+	}
+	startLead(us, channelTime[FT_CH_NUM_TRIGGER], lightLeadMs);
+}
+
+/* executes all sequence events that are due at the current seqMs */
+static void seqProcess(void) {
+	uint8_t *event;
+	uint32_t param;
+
+	while (seqIndex < FT_SEQ_MAX_EVENTS) {
+		event = seqTable + seqIndex * FT_SEQ_EVENT_SIZE;
+		if (readU32(event + 1) > seqMs) {
+			return;
+		}
+		param = readU32(event + 5);
+		trace(FT_TRACE_SEQ, event[0]);
+
+		switch (event[0]) {
+			case FT_SEQ_END:
+				seqRuns++;
+				// an end at offset 0 would loop forever within this tick
+				if (seqMs == 0 || (seqRunsLeft && --seqRunsLeft == 0)) {
+					seqState = FT_SEQ_STATE_DONE;
+					return;
+				}
+				seqIndex = 0;
+				seqMs = 0;
+				continue;
+
+			case FT_SEQ_TRIGGER:
+				startTrigger(channelTime[FT_CH_NUM_TRIGGER]);
+				break;
+
+			case FT_SEQ_LIGHT_ON:
+				SET_FLASH
+				break;
+
+			case FT_SEQ_LIGHT_OFF:
+				stopFlash();
+				break;
+
+			case FT_SEQ_FLASH:
+				startFlash(param ? param : flashTimeUs);
+				break;
+
+			case FT_SEQ_FLASH_AND_TRIGGER:
+				flashAndTrigger(param ? param : flashTimeUs);
+				break;
+
+			case FT_SEQ_CHANNEL_ON:
+				channelsOn(param);
+				break;
+
+			case FT_SEQ_CHANNEL_OFF:
+				channelsOff(param);
+				break;
+
+			case FT_SEQ_CHANNEL_PULSE:
+				channelsPulse(param);
+				break;
+		}
+		seqIndex++;
+	}
+	// ran off the end of the table
+	seqState = FT_SEQ_STATE_DONE;
+}
+
+/* decodes the received armed shot and precomputes everything fire() needs */
+static void armPrepare(void) {
+	uint32_t us = readU32(armData);
+
+	armLeadMs = (armData[4] << 8) | armData[5];
+	armPulseMs = armData[6] ? armData[6] : channelTime[FT_CH_NUM_TRIGGER];
+	armChannels = armData[7];
+
+	if (us == 0) {
+		armChannels &= ~FT_CH_FLASH;
+	}
+	armFlashUs = us;
+	armFlashUsLeft = us;
+	armFlashTicks = flashTimerChunk(&armFlashUsLeft);
+
+	// with a lead, trigger and flash start from the tick as in flashAndTrigger()
+	armLead = armLeadMs && (armChannels & FT_CH_TRIGGER);
+	armNow = armLead ? armChannels & ~(FT_CH_TRIGGER | FT_CH_FLASH) : armChannels;
+
+	portBits(armNow, &armPortSet, &armPortClear);
+	armAuxSet = AUX_BITS(armNow);
+
+	armed = 1;
+}
+
+/*
+ * Executes the armed shot. The outputs are switched first with the values
+ * of armPrepare(), in one write per port, the bookkeeping follows the edge.
+ * Trigger, flash and focus share a port, see defines.h.
+ */
+static void fire(void) {
+	uint16_t edge;
+	uint32_t now;
+	uint8_t i;
+
+	edge = switchOn(armPortSet, armPortClear, armAuxSet, (armNow & FT_CH_FLASH) ? armFlashTicks : 0, armFlashUsLeft);
+
+	for (i = 0; i < FT_CHANNELS; i++) {
+		if (i != FT_CH_NUM_FLASH && (armNow & (1 << i))) {
+			cli();
+			channelMsLeft[i] = i == FT_CH_NUM_TRIGGER ? armPulseMs : channelTime[i];
+			sei();
+		}
+	}
+	if (armNow & FT_CH_TRIGGER) {
+		now = deviceTime();
+		lagStart(now - (uint16_t)((uint16_t)now - edge));
+	}
+	if (armLead) {
+		startLead((armChannels & FT_CH_FLASH) ? armFlashUs : 0, armPulseMs, armLeadMs);
+	}
+	trace(FT_TRACE_ON, armNow);
+}
+
+/* fires the armed shot, or flash and trigger with the set times if nothing is armed */
+static void fireOrFlash(void) {
+
+	if (armed) {
+		fire();
+	} else {
+		flashAndTrigger(flashTimeUs);
+	}
+}
+
+/* decodes the received strobe and converts it to timer ticks */
+static void strobePrepare(void) {
+	uint32_t periodTicks = usToTicks(readU32(strobeData));
+
+	strobeOnTicks = usToTicks(readU32(strobeData + 4));
+	strobeOffTicks = periodTicks - strobeOnTicks;
+	strobePulses = (strobeData[8] << 8) | strobeData[9];
+
+	// a wrapped off time means an on time longer than the period
+	if (strobeOffTicks > periodTicks) {
+		strobeOffTicks = 0;
+	}
+	if (strobeOnTicks < STROBE_MIN_TICKS) {
+		strobeOnTicks = STROBE_MIN_TICKS;
+	}
+	if (strobeOffTicks < STROBE_MIN_TICKS) {
+		strobeOffTicks = STROBE_MIN_TICKS;
+	}
+}
+
+/* schedules the next compare of the strobe, the output changes only at the end of a phase */
+static void strobeSchedule(void) {
+	uint32_t ticks = strobeTicksLeft;
+
+	if (ticks > 2 * STROBE_CHUNK_TICKS) {
+		ticks = STROBE_CHUNK_TICKS;
+	} else if (ticks > STROBE_CHUNK_TICKS) {
+		ticks >>= 1;
+	}
+	strobeTicksLeft -= ticks;
+
+	if (strobeTicksLeft) {
+		// a compare within the phase keeps the output at its level
+		TCCR1A = strobeOn ? STROBE_ON_MODE : STROBE_OFF_MODE;
+	} else {
+		TCCR1A = strobeOn ? STROBE_OFF_MODE : STROBE_ON_MODE;
+	}
+	OCR1B += ticks;
+}
+
+/* starts the pulses of the strobe with the first on edge */
+static void strobeStart(void) {
+
+	stopFlash();
+
+	strobeOn = 0;
+	strobeTicksLeft = 0;
+	strobePulsesLeft = strobePulses;
+
+	cli();
+	// the output latch starts at the off level, the first compare switches it on
+	TCCR1A = STROBE_OFF_MODE;
+	TCCR1A |= (1 << FOC1B);
+	TCCR1A = STROBE_ON_MODE;
+	OCR1B = TCNT1 + FLASH_MIN_TICKS;
+	TIFR = (1 << OCF1B);
+	strobeActive = 1;
+	TIMSK |= (1 << OCIE1B);
+	sei();
+	trace(FT_TRACE_STROBE, 1);
+}
+
+static void strobeStop(void) {
+	if (strobeActive) {
+		trace(FT_TRACE_STROBE, 0);
+	}
+	stopFlash();
+	if (strobeWithTrigger) {
+		STOP_TRIGGER
+		strobeWithTrigger = 0;
+	}
+}
+
+/* runs the set strobe, with the trigger held around it if requested */
+static void strobeRun(uint8_t flags, uint16_t delayMs) {
+
+	strobeStop();
+	if (!(flags & FT_STROBE_RUN)) {
+		return;
+	}
+
+	if (flags & FT_STROBE_WITH_TRIGGER) {
+		strobeWithTrigger = 1;
+		channelsOn(FT_CH_TRIGGER);
+	}
+	if (delayMs) {
+		cli();
+		strobeDelayMsLeft = delayMs;
+		sei();
+	} else {
+		strobeStart();
+	}
+}
+
+/* half presses the camera remote for ms */
+static void startFocus(uint16_t ms) {
+	cli();
+	channelMsLeft[FT_CH_NUM_FOCUS] = ms;
+	sei();
+	SET_FOCUS
+}
+
+/* the usb frame number, as counted since power up */
+static uint16_t currentFrame(void) {
+	uint16_t frame;
+
+	cli();
+	frame = frameCount + (uint8_t)(usbSofCount - frameSofSeen);
+	sei();
+	return frame;
+}
+
+/* fires the armed shot at the start of frameTarget, called from the main loop */
+static void frameFirePoll(void) {
+	uint16_t start;
+	uint8_t sof;
+	int16_t framesLeft;
+
+	// the frame and the sof counter it is waited on must match
+	cli();
+	sof = usbSofCount;
+	framesLeft = frameTarget - (uint16_t)(frameCount + (uint8_t)(sof - frameSofSeen));
+	sei();
+
+	if (framesLeft > 1) {
+		return;
+	}
+	if (framesLeft < 1) {
+		frameState = FT_FRAME_MISSED;
+		return;
+	}
+
+	// busy wait for the frame start, this blocks usbPoll for less than 1ms
+	start = TCNT1;
+	while (usbSofCount == sof) {
+		if ((uint16_t)(TCNT1 - start) > FRAME_WAIT_TICKS) {
+			frameState = FT_FRAME_MISSED;
+			return;
+		}
+	}
+	fire();
+	// from the frame start, as Timer0 stamped it, to the edge: this includes the
+	// usb interrupt and the poll, which differ between controllers. Timer0 runs
+	// at the rate of Timer1 and wraps after 170us, far longer than the delay.
+	frameFireTicks = (uint8_t)(fireStamp - sofStamp);
+	frameState = FT_FRAME_FIRED;
+	trace(FT_TRACE_FRAME, frameTarget & 0xFF);
+}
+
+/* sets edge and pull up of the external trigger input and arms it, if enabled */
+static void extTriggerSetup(uint8_t flags, uint16_t debounceMs) {
+
+	cli();
+	GICR &= ~(1 << INT1);
+	extHoldMsLeft = 0;
+	sei();
+
+	extFlags = flags;
+	extDebounceMs = debounceMs;
+
+	if (flags & FT_EXT_PULLUP) {
+		PORTD |= (1 << PD3);
+	} else {
+		PORTD &= ~(1 << PD3);
+	}
+	// INT0 shares this register, its usb sense bits stay untouched
+	if (flags & FT_EXT_RISING) {
+		MCUCR |= (1 << ISC11) | (1 << ISC10);
+	} else {
+		MCUCR = (MCUCR & ~(1 << ISC10)) | (1 << ISC11);
+	}
+
+	if (flags & FT_EXT_ENABLE) {
+		// an edge from before arming must not fire
+		cli();
+		GIFR = (1 << INTF1);
+		GICR |= (1 << INT1);
+		sei();
+	}
+}
+
+/*
+ * Sets up the shutter lag measurement. The analog comparator compares the
+ * sync input on AIN1 with the internal bandgap reference and drives the
+ * input capture of Timer1, as ICP1 itself is taken by usb D-.
+ */
+static void lagSetup(uint8_t flags) {
+
+	uint8_t i;
+
+	cli();
+	TIMSK &= ~(1 << TICIE1);
+	lagMsLeft = 0;
+	sei();
+
+	lagCount = 0;
+	for (i = 0; i < FT_LAG_SAMPLES; i++) {
+		lagTicks[i] = 0;
+	}
+
+	if (!(flags & FT_LAG_ENABLE)) {
+		PORTD &= ~(1 << PD7);
+		ACSR = (1 << ACD); // comparator off
+		return;
+	}
+
+	// open hot shoe contacts need the pull up
+	if (flags & FT_LAG_RISING) {
+		PORTD &= ~(1 << PD7);
+	} else {
+		PORTD |= (1 << PD7);
+	}
+	ACSR = (1 << ACBG) | (1 << ACIC);
+
+	// the comparator output is high while the sync input is below the reference
+	if (flags & FT_LAG_RISING) {
+		TCCR1B = (TCCR1B & ~(1 << ICES1)) | (1 << ICNC1);
+	} else {
+		TCCR1B |= (1 << ICES1) | (1 << ICNC1);
+	}
+
+	cli();
+	TIFR = (1 << ICF1);
+	TIMSK |= (1 << TICIE1);
+	sei();
+}
+
+/* hands a new external trigger event to the interrupt endpoint, called from the main loop */
+static void extEventPoll(void) {
+	static uchar report[FT_EVENT_SIZE];
+	uint8_t i;
+
+	if (!usbInterruptIsReady()) {
+		return;
+	}
+	// copy again, if the next event came in while copying
+	do {
+		extEventPending = 0;
+		for (i = 0; i < FT_EVENT_SIZE; i++) {
+			report[i] = extEvent[i];
+		}
+	} while (extEventPending);
+
+	usbSetInterrupt(report, FT_EVENT_SIZE);
+}
+
+/* the flash time left, of the current chunk and the chunks to come */
+static uint32_t flashTimeLeft(void) {
+	uint16_t ticks;
+	uint32_t us;
+
+	cli();
+	if (!(TIMSK & (1 << OCIE1B)) || strobeActive) {
+		sei();
+		return 0;
+	}
+	ticks = OCR1B - TCNT1;
+	us = flashTimeUsLeft;
+	sei();
+	return us + TICKS_TO_US(ticks);
+}
+
+/* measures the timer against the frame stamps, called by the tick */
+static void clockTick(void) {
+	uint8_t sof, stamp, frames;
+	int8_t err;
+	int32_t corr;
+
+	cli();
+	sof = usbSofCount;
+	stamp = sofStamp;
+	sei();
+
+	frames = sof - clockSofSeen;
+	if (!frames) {
+		// no frames, e.g. a suspended bus or INT0 on D+
+		if (clockIdleMs < 255) {
+			clockIdleMs++;
+		}
+		return;
+	}
+
+	// the stamp moves by the ticks of the frames modulo 256, the rest is the error
+	err = (int8_t)(uint8_t)(stamp - clockStampSeen - (uint8_t)(frames * TICKS_PER_MS));
+	clockSofSeen = sof;
+	clockStampSeen = stamp;
+
+	if (clockIdleMs > 2 || frames > 4 || err > CLOCK_MAX_STEP_TICKS || err < -CLOCK_MAX_STEP_TICKS) {
+		// the stamps before are not comparable, start a new window from here
+		clockIdleMs = 0;
+		clockErrTicks = 0;
+		clockFrames = 0;
+		return;
+	}
+	clockIdleMs = 0;
+	clockErrTicks += err;
+	clockFrames += frames;
+
+	if (clockFrames < FT_CLOCK_WINDOW) {
+		return;
+	}
+
+	// error per tick of the window, scaled to 1/2^24
+	corr = ((int32_t)clockErrTicks << 14) / (int32_t)((TICKS_PER_MS * (uint32_t)clockFrames) >> 10);
+	clockErrTicks = 0;
+	clockFrames = 0;
+	if (corr > CLOCK_MAX_CORR || corr < -CLOCK_MAX_CORR) {
+		return;
+	}
+	clockMeasured = corr;
+
+	// the first window is taken as it is, later ones only move the correction
+	cli();
+	clockCorr = clockWindows ? clockCorr + (corr - clockCorr) / 4 : corr;
+	sei();
+	clockWindows++;
+
+	tickStep = ((uint32_t)TICKS_PER_MS << 16) + (((int32_t)TICKS_PER_MS * clockCorr) >> 8);
+}
+
+/* fills the status block, see FT_STATUS_SIZE for the layout */
+static void statusFill(uint8_t *p) {
+	uint8_t flags = 0;
+
+	if (armed) {
+		flags |= FT_STATUS_ARMED;
+	}
+	if (strobeActive || strobeDelayMsLeft) {
+		flags |= FT_STATUS_STROBE;
+	}
+	if (GICR & (1 << INT1) || extHoldMsLeft) {
+		flags |= FT_STATUS_EXT_ARMED;
+	}
+	if (frameState == FT_FRAME_PENDING) {
+		flags |= FT_STATUS_FRAME_PENDING;
+	}
+	if (lagMsLeft) {
+		flags |= FT_STATUS_LAG_WAITING;
+	}
+	if (leadFlashPending || leadMsLeft) {
+		flags |= FT_STATUS_LEAD_PENDING;
+	}
+	if (focusFireMsLeft) {
+		flags |= FT_STATUS_FOCUS_PENDING;
+	}
+
+	p[0] = FT_STATUS_VERSION;
+	p[1] = FT_STATUS_SIZE;
+	p[2] = channelsState();
+	p[3] = flags;
+	writeU32(p + 4, flashTimeUs);
+	writeU32(p + 8, flashTimeLeft());
+	p[12] = seqState;
+	p[13] = seqIndex;
+	p[14] = (uint8_t)(seqRuns >> 8);
+	p[15] = (uint8_t)(seqRuns & 0xFF);
+	writeU32(p + 16, cmdTimestamp);
+}
 
 
 usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 	usbRequest_t *rq = (void *)data;
-	static uchar buffer[2];
-	
+	static uchar buffer[1 + 2 * FT_CHANNELS];
+	static uchar lagBuffer[FT_CMD_LAG_GET_LEN];
+	static uchar statusBuffer[FT_STATUS_SIZE];
+	uint32_t ms;
+	uint16_t offset;
 	
+	// hid class requests of hidraw, the usb hid driver sends SET_IDLE as well
+	if ((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS) {
+		if (rq->bRequest == USBRQ_HID_SET_REPORT && rq->wLength.word >= FT_OUT_SIZE
+			&& rq->wLength.word <= FT_HID_FEATURE_SIZE) {
+			writePtr = hidPacket;
+			writeLeft = FT_OUT_SIZE;
+			writeCmd = WRITE_HID_REPORT;
+			hidDataLen = rq->wLength.word - FT_OUT_SIZE;
+			return USB_NO_MSG;
+		}
+		if (rq->bRequest == USBRQ_HID_GET_REPORT) {
+			usbMsgPtr = hidReplyPtr;
+			return hidReplyLen;
+		}
+		return 0;
+	}
+
+	// checked ahead of the switch to keep the shot latency minimal
+	if (rq->bRequest == FT_CMD_FIRE) {
+		if (armed) {
+			fire();
+		}
+		prevCmdTimestamp = cmdTimestamp;
+		cmdTimestamp = deviceTime();
+		cmdCount++;
+		trace(FT_TRACE_CMD, FT_CMD_FIRE);
+		return 0;
+	}
+
+	prevCmdTimestamp = cmdTimestamp;
+	cmdTimestamp = deviceTime();
+	cmdCount++;
+	// reading the trace must not record itself
+	if (rq->bRequest != FT_CMD_TRACE_GET) {
+		trace(FT_TRACE_CMD, rq->bRequest);
+	}
+
 	switch(rq->bRequest) {
 
 		case FT_CMD_TRIGGER:
-			SET_TRIGGER
+			startTrigger(channelTime[FT_CH_NUM_TRIGGER]);
 			return 0; 
 
 		case FT_CMD_FLASH_AND_TRIGGER:
-			flashTimeLeft = flashTime;
-			SET_FLASH
-			SET_TRIGGER
-			ENABLE_TIMER;
+			flashAndTrigger(flashTimeUs);
 			return 0;
 
 		case FT_CMD_LIGHT_ON:
@@ -100,7 +1187,7 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 			return 0;
 
 		case FT_CMD_LIGHT_OFF:
-			STOP_FLASH;
+			stopFlash();
 			// ledRedOff();
 			return 0;
 
@@ -112,20 +1199,268 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 				buffer[0] ^= 0x01;
 			#endif
     		usbMsgPtr = buffer;
-    		return 1;
+    		return FT_CMD_LIGHT_STATE_LEN;
 
     	case FT_CMD_FLASH_TIME_SET:
-    		flashTime = (rq->wValue.bytes[1] << 8);
-    		flashTime |= rq->wValue.bytes[0];
+    		flashTimeUs = (uint32_t)rq->wValue.word * 1000;
     		return 0;
 
     	case FT_CMD_FLASH_TIME_GET:
-    		
-    		buffer[0] = (uchar)(flashTime >> 8);
-    		buffer[1] = (uchar)(flashTime & 0xFF);
+    		ms = flashTimeUs / 1000;
+    		if (ms > 0xFFFF) {
+    			ms = 0xFFFF;
+    		}
+    		buffer[0] = (uchar)(ms >> 8);
+    		buffer[1] = (uchar)(ms & 0xFF);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_FLASH_TIME_GET_LEN;
+
+    	case FT_CMD_FLASH_TIME_US_SET:
+    		// lower 16 bit in wValue, upper 16 bit in wIndex
+    		flashTimeUs = ((uint32_t)rq->wIndex.word << 16) | rq->wValue.word;
+    		return 0;
+
+    	case FT_CMD_FLASH_TIME_US_GET:
+    		buffer[0] = (uchar)(flashTimeUs >> 24);
+    		buffer[1] = (uchar)(flashTimeUs >> 16);
+    		buffer[2] = (uchar)(flashTimeUs >> 8);
+    		buffer[3] = (uchar)(flashTimeUs & 0xFF);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_FLASH_TIME_US_GET_LEN;
+
+    	case FT_CMD_SEQ_UPLOAD:
+    		// the table must not change under a running sequence
+    		if (seqState == FT_SEQ_STATE_RUNNING) {
+    			return 0;
+    		}
+    		offset = rq->wValue.word * FT_SEQ_EVENT_SIZE;
+    		if (offset >= sizeof(seqTable)) {
+    			return 0;
+    		}
+    		writePtr = seqTable + offset;
+    		writeLeft = sizeof(seqTable) - offset;
+    		if (rq->wLength.word < writeLeft) {
+    			writeLeft = rq->wLength.word;
+    		}
+    		writeCmd = FT_CMD_SEQ_UPLOAD;
+    		return USB_NO_MSG; // receive the events in usbFunctionWrite
+
+    	case FT_CMD_FRAME_FIRE:
+    		if (!armed) {
+    			return 0;
+    		}
+    		frameTarget = rq->wValue.word;
+    		frameState = FT_FRAME_PENDING;
+    		return 0;
+
+    	case FT_CMD_FRAME_GET:
+    		offset = currentFrame();
+    		buffer[0] = (uchar)(offset >> 8);
+    		buffer[1] = (uchar)(offset & 0xFF);
+    		buffer[2] = frameState;
+    		buffer[3] = (uchar)(frameTarget >> 8);
+    		buffer[4] = (uchar)(frameTarget & 0xFF);
+    		buffer[5] = (uchar)(frameFireTicks >> 8);
+    		buffer[6] = (uchar)(frameFireTicks & 0xFF);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_FRAME_GET_LEN;
+
+    	case FT_CMD_CHANNEL_ON:
+    		channelsOn(rq->wValue.bytes[0]);
+    		return 0;
+
+    	case FT_CMD_CHANNEL_OFF:
+    		channelsOff(rq->wValue.bytes[0]);
+    		return 0;
+
+    	case FT_CMD_CHANNEL_PULSE:
+    		channelsPulse(rq->wValue.bytes[0]);
+    		return 0;
+
+    	case FT_CMD_CHANNEL_TIME_SET:
+    		if (rq->wIndex.word < FT_CHANNELS) {
+    			channelTime[rq->wIndex.word] = rq->wValue.word;
+    		}
+    		return 0;
+
+    	case FT_CMD_CHANNEL_GET:
+    		buffer[0] = channelsState();
+    		for (offset = 0; offset < FT_CHANNELS; offset++) {
+    			buffer[1 + 2 * offset] = (uchar)(channelTime[offset] >> 8);
+    			buffer[2 + 2 * offset] = (uchar)(channelTime[offset] & 0xFF);
+    		}
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_CHANNEL_GET_LEN;
+
+    	case FT_CMD_TIMESTAMP_GET:
+    		writeU32(buffer, prevCmdTimestamp);
+    		writeU32(buffer + 4, cmdTimestamp);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_TIMESTAMP_GET_LEN;
+
+    	case FT_CMD_ARM:
+    		if (rq->wLength.word != FT_CMD_ARM_LEN) {
+    			return 0;
+    		}
+    		armed = 0;
+    		writePtr = armData;
+    		writeLeft = FT_ARM_SIZE;
+    		writeCmd = FT_CMD_ARM;
+    		return USB_NO_MSG;
+
+    	case FT_CMD_SEQ_START:
+    		seqState = FT_SEQ_STATE_IDLE; // keep the tick away while setting up
+    		seqIndex = 0;
+    		seqRuns = 0;
+    		seqRunsLeft = rq->wValue.word;
+    		seqMs = 0xFFFFFFFF; // the next tick starts at offset 0
+    		seqState = FT_SEQ_STATE_RUNNING;
+    		return 0;
+
+    	case FT_CMD_SEQ_ABORT:
+    		if (seqState == FT_SEQ_STATE_RUNNING) {
+    			seqState = FT_SEQ_STATE_ABORTED;
+    			stopFlash();
+    		}
+    		return 0;
+
+    	case FT_CMD_SEQ_STATUS:
+    		cli();
+    		ms = seqMs;
+    		sei();
+    		buffer[0] = seqState;
+    		buffer[1] = seqIndex;
+    		buffer[2] = (uchar)(seqRuns >> 8);
+    		buffer[3] = (uchar)(seqRuns & 0xFF);
+    		writeU32(buffer + 4, ms);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_SEQ_STATUS_LEN;
+
+    	case FT_CMD_PREFOCUS:
+    		startFocus(rq->wValue.word ? rq->wValue.word : channelTime[FT_CH_NUM_FOCUS]);
+    		return 0;
+
+    	case FT_CMD_FOCUS_FIRE:
+    		if (rq->wValue.word == 0) {
+    			fireOrFlash();
+    			return 0;
+    		}
+    		// the half press is held through the full press
+    		ms = armed ? armLeadMs + armPulseMs : channelTime[FT_CH_NUM_TRIGGER];
+    		startFocus(rq->wValue.word + ms);
+    		cli();
+    		focusFireMsLeft = rq->wValue.word;
+    		sei();
+    		return 0;
+
+    	case FT_CMD_TRACE_GET:
+    		// stops recording, so the ring does not change while it is sent
+    		traceFrozen = 1;
+
+    		usbMsgPtr = traceBuffer;
+    		return FT_CMD_TRACE_GET_LEN;
+
+    	case FT_CMD_TRACE_RESET:
+    		cli();
+    		traceBuffer[0] = 0;
+    		traceBuffer[1] = 0;
+    		sei();
+    		cmdCount = 0;
+    		flashRestarts = 0;
+    		maxIsrLatency = 0;
+    		traceFrozen = 0;
+    		return 0;
+
+    	case FT_CMD_COUNTERS_GET:
+    		buffer[0] = (uchar)(cmdCount >> 8);
+    		buffer[1] = (uchar)(cmdCount & 0xFF);
+    		buffer[2] = (uchar)(flashRestarts >> 8);
+    		buffer[3] = (uchar)(flashRestarts & 0xFF);
+    		buffer[4] = (uchar)(maxIsrLatency >> 8);
+    		buffer[5] = (uchar)(maxIsrLatency & 0xFF);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_COUNTERS_GET_LEN;
+
+    	case FT_CMD_CLOCK_GET:
+    		writeU32(buffer, (int32_t)clockCorr);
+    		writeU32(buffer + 4, (int32_t)clockMeasured);
+    		buffer[8] = (uchar)(clockWindows >> 8);
+    		buffer[9] = (uchar)(clockWindows & 0xFF);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_CLOCK_GET_LEN;
+
+    	case FT_CMD_STATUS:
+    		statusFill(statusBuffer);
+
+    		usbMsgPtr = statusBuffer;
+    		return FT_CMD_STATUS_LEN;
+
+    	case FT_CMD_STROBE_SET:
+    		if (rq->wLength.word != FT_CMD_STROBE_SET_LEN) {
+    			return 0;
+    		}
+    		writePtr = strobeData;
+    		writeLeft = FT_STROBE_SIZE;
+    		writeCmd = FT_CMD_STROBE_SET;
+    		return USB_NO_MSG;
+
+    	case FT_CMD_STROBE_RUN:
+    		strobeRun(rq->wValue.bytes[0], rq->wIndex.word);
+    		return 0;
+
+    	case FT_CMD_LIGHT_LEAD_SET:
+    		lightLeadMs = rq->wValue.word;
+    		lightTailMs = rq->wIndex.word;
+    		return 0;
+
+    	case FT_CMD_LIGHT_LEAD_GET:
+    		buffer[0] = (uchar)(lightLeadMs >> 8);
+    		buffer[1] = (uchar)(lightLeadMs & 0xFF);
+    		buffer[2] = (uchar)(lightTailMs >> 8);
+    		buffer[3] = (uchar)(lightTailMs & 0xFF);
+
+    		usbMsgPtr = buffer;
+    		return FT_CMD_LIGHT_LEAD_GET_LEN;
+
+    	case FT_CMD_LAG_SETUP:
+    		lagSetup(rq->wValue.bytes[0]);
+    		return 0;
+
+    	case FT_CMD_LAG_GET:
+    		// oldest first, from the ring in a buffer of its own
+    		lagBuffer[0] = lagCount;
+    		for (offset = 0; offset < FT_LAG_SAMPLES; offset++) {
+    			cli();
+    			ms = lagTicks[(uint8_t)(lagCount + offset) % FT_LAG_SAMPLES];
+    			sei();
+    			writeU32(lagBuffer + 1 + 4 * offset, ms);
+    		}
+
+    		usbMsgPtr = lagBuffer;
+    		return FT_CMD_LAG_GET_LEN;
+
+    	case FT_CMD_EXT_ARM:
+    		extTriggerSetup(rq->wValue.bytes[0], rq->wIndex.word);
+    		return 0;
+
+    	case FT_CMD_EXT_STATUS:
+    		buffer[0] = extFlags;
+    		buffer[1] = (uchar)(extDebounceMs >> 8);
+    		buffer[2] = (uchar)(extDebounceMs & 0xFF);
+    		for (offset = 0; offset < FT_EVENT_SIZE; offset++) {
+    			buffer[3 + offset] = extEvent[offset];
+    		}
 
     		usbMsgPtr = buffer;
-    		return 2;
+    		return FT_CMD_EXT_STATUS_LEN;
 
 
 	}
@@ -134,6 +1469,102 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8]) {
 	return 0; // by default don't return any data
 }
 
+/* processes a command packet like a setup, with dataLen bytes of data stage */
+static usbMsgLen_t commandPacket(uint8_t *packet, uint8_t dataLen) {
+	uint8_t setup[8];
+	uint8_t i;
+
+	if (packet[0] != FT_OUT_COMMAND) {
+		return 0;
+	}
+	setup[0] = FT_REQ_OUT;
+	for (i = 1; i < FT_OUT_SIZE; i++) {
+		setup[i] = packet[i];
+	}
+	setup[6] = dataLen;
+	setup[7] = 0;
+	return usbFunctionSetup(setup);
+}
+
+/* runs the command of a complete hid feature packet, its data stage may follow */
+static void hidCommand(void) {
+	usbMsgLen_t len;
+
+	len = commandPacket(hidPacket, hidDataLen);
+	if (len == USB_NO_MSG) {
+		// the command set the target of its data, the rest of the report goes there
+		hidReplyLen = 0;
+		return;
+	}
+	writeLeft = 0;
+	hidReplyPtr = usbMsgPtr;
+	hidReplyLen = len;
+}
+
+uchar usbFunctionWrite(uchar *data, uchar len) {
+	uint8_t i;
+
+	for (i = 0; i < len && writeLeft; i++) {
+		*writePtr++ = data[i];
+		if (--writeLeft == 0 && writeCmd == WRITE_HID_REPORT) {
+			hidCommand();
+		}
+	}
+	if (writeLeft) {
+		return 0;
+	}
+
+	if (writeCmd == FT_CMD_ARM) {
+		armPrepare();
+	} else if (writeCmd == FT_CMD_STROBE_SET) {
+		strobePrepare();
+	}
+	return 1; // ends the transfer
+}
+
+/*
+ * Standard requests that put the host back to DATA0 on the interrupt out
+ * endpoint: SET_CONFIGURATION, SET_INTERFACE and a clear of its halt. The
+ * next packet is taken whatever token it has, as after a bus reset.
+ */
+void outTokenSetup(uchar *setup) {
+	usbRequest_t *rq = (void *)setup;
+
+	if ((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_STANDARD) {
+		return;
+	}
+	if (rq->bRequest == USBRQ_SET_CONFIGURATION || rq->bRequest == USBRQ_SET_INTERFACE
+		|| (rq->bRequest == USBRQ_CLEAR_FEATURE && (rq->bmRequestType & USBRQ_RCPT_MASK) == USBRQ_RCPT_ENDPOINT
+			&& rq->wValue.word == 0 && rq->wIndex.bytes[0] == FT_OUT_ENDPOINT)) {
+		outToken = 0;
+	}
+}
+
+/* a command from the interrupt out endpoint, processed as a setup without data stage */
+void usbFunctionWriteOut(uchar *data, uchar len) {
+	uchar *msgPtr = usbMsgPtr;
+	uint8_t *ptr = writePtr;
+	uint8_t left = writeLeft;
+	uint8_t cmd = writeCmd;
+
+	// the host sends a packet again if it missed the ack, it must not fire twice
+	if (usbCurrentDataToken == outToken) {
+		return;
+	}
+	outToken = usbCurrentDataToken;
+
+	if (usbRxToken != FT_OUT_ENDPOINT || len != FT_OUT_SIZE) {
+		return;
+	}
+	commandPacket(data, 0);
+
+	// a control transfer may be between its stages, it keeps its reply and data target
+	usbMsgPtr = msgPtr;
+	writePtr = ptr;
+	writeLeft = left;
+	writeCmd = cmd;
+}
+
 
 
 
@@ -145,7 +1576,9 @@ int main() {
 	PORTB = 0;
 
 	/* PD2 = INT0  must be input: for usb interrupts */
-	DDRD = ~(1 << PD2);
+	/* PD3 = INT1  is the external trigger input */
+	/* PD7 = AIN1  is the flash sync input */
+	DDRD = (uint8_t)~((1 << PD2) | (1 << PD3) | (1 << PD7));
 
 	/* output SE0 for USB reset */
 	DDRB = ~0;
@@ -162,13 +1595,16 @@ int main() {
 	DDRB = 0;
 	TRIGGERDDR |= (1 << TRIGGERPIN); 
 	FLASHDDR |= (1 << FLASHPIN);
+	FOCUSDDR |= (1 << FOCUSPIN);
 
 	STOP_FLASH;
 	STOP_TRIGGER;
+	STOP_FOCUS;
 
 	/* all inputs except PC0, PC1, PC2*/
 	DDRC = 0x07;
 	PORTC = 0;
+	AUXDDR |= AUX_BITS(FT_CH_AUX_MASK);
 
 
 	/* init usb  */
@@ -190,22 +1626,25 @@ int main() {
 
 	/* Init timer */
 	TCCR1A  = 0; // no pwm and no output pin
-	TIMSK  |= (1 << OCIE1A); // compare enable enable
-	TCCR1B |= (1 << WGM12); // CTC Mode
-	OCR1A = 1499; //compare value for 1 ms resolution with 1.5 MHz clock
+	TCCR0 = (1 << CS01); // prescaler 8 as Timer1, stamps the usb frames
+	START_TIMER; // normal mode, the compare units schedule against TCNT1
+	OCR1A = TICKS_PER_MS;
+	TIMSK |= (1 << OCIE1A); // 1ms system tick, also carries the device time
 
 	
 	for (;;) {
 		//  check for new usb events
 		usbPoll();
 
-		/* if trigger is set, then clear it after 30ms */
-		if (TRIGGER_STATE)
+		if (frameState == FT_FRAME_PENDING)
 		{
-			_delay_ms(30);
-			STOP_TRIGGER;
+			frameFirePoll();
 		}
 
+		if (extEventPending)
+		{
+			extEventPoll();
+		}
 
 
 	}
@@ -214,15 +1653,196 @@ int main() {
 
 
 
-ISR (TIMER1_COMPA_vect)
+ISR (TIMER1_COMPA_vect, ISR_NOBLOCK)
 {
 	/* Interrupt happens every 1ms */
+	uint8_t i, off;
+	uint16_t latency;
+	uint32_t step;
+
+	cli();
+	latency = TCNT1 - OCR1A;
+	tickTime += (uint16_t)(OCR1A - (uint16_t)tickTime);
+	sei();
+	if (latency > maxIsrLatency)
+	{
+		maxIsrLatency = latency;
+	}
+
+	// the tick follows the usb frames, the fraction of a tick is carried on
+	step = tickFraction + tickStep;
+	OCR1A += (uint16_t)(step >> 16);
+	tickFraction = (uint16_t)step;
+
+	// fold the sof counter into the frame count before its 8 bit wrap
+	cli();
+	frameCount += (uint8_t)(usbSofCount - frameSofSeen);
+	frameSofSeen = usbSofCount;
+	sei();
 
-	flashTimeLeft--;
-	if (flashTimeLeft == 0)
+	clockTick();
+
+	// the channels are released by the tick, so the main loop never blocks on them
+	off = 0;
+	for (i = 0; i < FT_CHANNELS; i++)
+	{
+		if (channelMsLeft[i] && --channelMsLeft[i] == 0)
+		{
+			off |= (1 << i);
+		}
+	}
+	if (off)
+	{
+		channelsOff(off);
+	}
+
+	// a light lead starts on the tick, so that the trigger follows it by whole ticks
+	if (leadFlashPending)
+	{
+		leadFlashPending = 0;
+		startFlash(leadFlashUs);
+	}
+
+	if (leadMsLeft && --leadMsLeft == 0)
+	{
+		startTrigger(leadPulseMs);
+	}
+
+	if (lagMsLeft)
+	{
+		lagMsLeft--;
+	}
+
+	if (strobeDelayMsLeft && --strobeDelayMsLeft == 0)
+	{
+		strobeStart();
+	}
+
+	if (focusFireMsLeft && --focusFireMsLeft == 0)
+	{
+		fireOrFlash();
+	}
+
+	// the external trigger is ignored for the debounce time after an event
+	if (extHoldMsLeft && --extHoldMsLeft == 0)
+	{
+		cli();
+		GIFR = (1 << INTF1);
+		GICR |= (1 << INT1);
+		sei();
+	}
+
+	if (seqState == FT_SEQ_STATE_RUNNING)
+	{
+		seqMs++;
+		seqProcess();
+	}
+
+}
+
+ISR (TIMER1_COMPB_vect, ISR_NOBLOCK)
+{
+	/* Interrupt happens at the end of every flash timer chunk and strobe phase */
+	uint16_t latency;
+
+	cli();
+	latency = TCNT1 - OCR1B;
+	sei();
+	if (latency > maxIsrLatency)
+	{
+		maxIsrLatency = latency;
+	}
+
+	if (strobeActive)
+	{
+		if (strobeTicksLeft == 0)
+		{
+			// the compare was an edge of the output
+			strobeOn ^= 1;
+			if (!strobeOn && strobePulsesLeft && --strobePulsesLeft == 0)
+			{
+				strobeStop();
+				return;
+			}
+			strobeTicksLeft = strobeOn ? strobeOnTicks : strobeOffTicks;
+		}
+		strobeSchedule();
+		return;
+	}
+
+	if (flashTimeUsLeft == 0)
 	{
 		STOP_FLASH;
-		STOP_TIMER;
+		TIMSK &= ~(1 << OCIE1B);
+		trace(FT_TRACE_OFF, FT_CH_FLASH);
+		return;
+	}
+	OCR1B += flashTimerChunk(&flashTimeUsLeft);
+
+}
+
+ISR (INT1_vect, ISR_NOBLOCK)
+{
+	/* Interrupt happens on the armed edge of the external trigger */
+	uint16_t start = TCNT1;
+	uint16_t ticks;
+	uint32_t now;
+
+	// a bouncing input may have nested here before it was disabled, that one fired already
+	cli();
+	if (!(GICR & (1 << INT1)))
+	{
+		sei();
+		return;
+	}
+	GICR &= ~(1 << INT1);
+	sei();
+
+	fireOrFlash();
+	now = deviceTime();
+	ticks = (uint16_t)now - start;
+
+	extEvent[1]++;
+	writeU32(extEvent + 2, now - ticks);
+	extEvent[6] = (uint8_t)(ticks >> 8);
+	extEvent[7] = (uint8_t)(ticks & 0xFF);
+	extEventPending = 1;
+	trace(FT_TRACE_EXT, extEvent[1]);
+
+	if (extFlags & FT_EXT_REARM)
+	{
+		// one more tick, so that at least the full debounce time passes
+		cli();
+		extHoldMsLeft = extDebounceMs + 1;
+		sei();
+	}
+	else
+	{
+		extFlags &= ~FT_EXT_ENABLE;
+	}
+}
+
+ISR (TIMER1_CAPT_vect, ISR_NOBLOCK)
+{
+	/* Interrupt happens on the flash sync edge of the camera */
+	uint16_t capture;
+	uint32_t now;
+
+	// ICR1 shares the 16 bit access register with the other timer registers
+	cli();
+	capture = ICR1;
+	sei();
+	now = deviceTime();
+
+	if (!lagMsLeft)
+	{
+		// no trigger waiting for its sync
+		return;
 	}
+	lagMsLeft = 0;
 
+	// extend the capture to 32 bit from the time it happened before now
+	lagTicks[lagCount % FT_LAG_SAMPLES] = now - (uint16_t)((uint16_t)now - capture) - lagTriggerTime;
+	lagCount++;
+	trace(FT_TRACE_SYNC, lagCount);
 }
@@ -121,7 +121,7 @@ section at the end of this file).
  * The value is in milliamperes. [It will be divided by two since USB
  * communicates power requirements in units of 2 mA.]
  */
-#define USB_CFG_IMPLEMENT_FN_WRITE      0
+#define USB_CFG_IMPLEMENT_FN_WRITE      1
 /* Set this to 1 if you want usbFunctionWrite() to be called for control-out
  * transfers. Set it to 0 if you don't need it and want to save a couple of
  * bytes.
@@ -132,7 +132,7 @@ section at the end of this file).
  * data from a static buffer, set it to 0 and return the data from
  * usbFunctionSetup(). This saves a couple of bytes.
  */
-#define USB_CFG_IMPLEMENT_FN_WRITEOUT   0
+#define USB_CFG_IMPLEMENT_FN_WRITEOUT   1
 /* Define this to 1 if you want to use interrupt-out (or bulk out) endpoints.
  * You must implement the function usbFunctionWriteOut() which receives all
  * interrupt/bulk data sent to any endpoint other than 0. The endpoint number
@@ -153,17 +153,18 @@ section at the end of this file).
  * in a single control-in or control-out transfer. Note that the capability
  * for long transfers increases the driver size.
  */
-/* #define USB_RX_USER_HOOK(data, len)     if(usbRxToken == (uchar)USBPID_SETUP) blinkLED(); */
+#define USB_RX_USER_HOOK(data, len)     if(usbRxToken == (uchar)USBPID_SETUP){outTokenSetup(data);}
 /* This macro is a hook if you want to do unconventional things. If it is
  * defined, it's inserted at the beginning of received message processing.
  * If you eat the received message and don't want default processing to
  * proceed, do a return after doing your things. One possible application
  * (besides debugging) is to flash a status LED on each packet.
  */
-/*#define USB_RESET_HOOK(resetStarts)     if(!resetStarts){hadUsbReset();}
+#define USB_RESET_HOOK(resetStarts)     if(!resetStarts){outToken = 0;}
 #ifndef __ASSEMBLER__
-extern void hadUsbReset(void); // define the function for usbdrv.c
-#endif*/
+extern unsigned char outToken; // last data token on the interrupt out endpoint, main.c
+extern void outTokenSetup(unsigned char *setup);
+#endif
 /* This macro is a hook if you need to know when an USB RESET occurs. It has
  * one parameter which distinguishes between the start of RESET state and its
  * end.
@@ -172,10 +173,12 @@ extern void hadUsbReset(void); // define the function for usbdrv.c
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
-#define USB_COUNT_SOF                   0
+#define USB_COUNT_SOF                   1
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
+ * FlashTrig: frame synchronized firing uses it. With INT0 still wired to D+
+ * the counter stays at 0 and FT_CMD_FRAME_FIRE ends as a missed frame.
  */
 /* #ifdef __ASSEMBLER__
  * macro myAssemblerMacro
@@ -196,13 +199,26 @@ extern void hadUsbReset(void); // define the function for usbdrv.c
  * Please note that Start Of Frame detection works only if D- is wired to the
  * interrupt, not D+. THIS IS DIFFERENT THAN MOST EXAMPLES!
  */
-#define USB_CFG_CHECK_DATA_TOGGLING     0
+#ifdef __ASSEMBLER__
+macro sofStampMacro
+    in      YL, TCNT0
+    sts     sofStamp, YL
+    endm
+#endif
+#define USB_SOF_HOOK                    sofStampMacro
+/* FlashTrig: stamps every frame with Timer0, which runs at the clock of
+ * Timer1. The 1ms tick measures the timer against the frames from it.
+ */
+#define USB_CFG_CHECK_DATA_TOGGLING     1
 /* define this macro to 1 if you want to filter out duplicate data packets
  * sent by the host. Duplicates occur only as a consequence of communication
  * errors, when the host does not receive an ACK. Please note that you need to
  * implement the filtering yourself in usbFunctionWriteOut() and
  * usbFunctionWrite(). Use the global usbCurrentDataToken and a static variable
  * for each control- and out-endpoint to check for duplicate packets.
+ * FlashTrig: a repeated command on the interrupt out endpoint could fire a
+ * second shot, usbFunctionWriteOut() drops it. The token is forgotten on a
+ * bus reset, when the host starts again with DATA0.
  */
 #define USB_CFG_HAVE_MEASURE_FRAME_LENGTH   0
 /* define this macro to 1 if you want the function usbMeasureFrameLength()
@@ -283,7 +299,7 @@ extern void hadUsbReset(void); // define the function for usbdrv.c
  * HID class is 3, no subclass and protocol required (but may be useful!)
  * CDC class is 2, use subclass 2 and protocol 1 for ACM
  */
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    0
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    33
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  * If you use this define, you must add a PROGMEM character array named
@@ -349,7 +365,7 @@ extern void hadUsbReset(void); // define the function for usbdrv.c
  */
 
 #define USB_CFG_DESCR_PROPS_DEVICE                  0
-#define USB_CFG_DESCR_PROPS_CONFIGURATION           0
+#define USB_CFG_DESCR_PROPS_CONFIGURATION           USB_PROP_LENGTH(41)
 #define USB_CFG_DESCR_PROPS_STRINGS                 0
 #define USB_CFG_DESCR_PROPS_STRING_0                0
 #define USB_CFG_DESCR_PROPS_STRING_VENDOR           0
@@ -358,6 +374,10 @@ extern void hadUsbReset(void); // define the function for usbdrv.c
 #define USB_CFG_DESCR_PROPS_HID                     0
 #define USB_CFG_DESCR_PROPS_HID_REPORT              0
 #define USB_CFG_DESCR_PROPS_UNKNOWN                 0
+/* FlashTrig: the configuration descriptor is in main.c, it adds the interrupt
+ * out endpoint 1 for commands to the one of the driver. The HID report
+ * descriptor for hidraw is there as well.
+ */
 
 /* ----------------------- Optional MCU Description ------------------------ */
 
@@ -725,14 +725,12 @@ typedef struct usbRequest{
 
 /* USB HID Requests */
 
-/*
-  not an hid product
 #define USBRQ_HID_GET_REPORT    0x01
 #define USBRQ_HID_GET_IDLE      0x02
 #define USBRQ_HID_GET_PROTOCOL  0x03
 #define USBRQ_HID_SET_REPORT    0x09
 #define USBRQ_HID_SET_IDLE      0x0a
-#define USBRQ_HID_SET_PROTOCOL  0x0b*/
+#define USBRQ_HID_SET_PROTOCOL  0x0b
 
 /* ------------------------------------------------------------------------- */
 
@@ -11,6 +11,8 @@
 #include <linux/errno.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
 #include <linux/usb.h>
 #include "../common/defines.h"
 
@@ -25,99 +27,274 @@ static const struct usb_device_id id_table[] = {
 
 MODULE_DEVICE_TABLE (usb, id_table);
 
+/* reply lengths and how the value of each command is split, from FT_PROTOCOL */
+FT_PROTOCOL_LENGTHS;
+
+#define FT_VALUE_ENCODING(command, type, value, length) [command] = value,
+static const u8 value_encoding[256] = { FT_PROTOCOL(FT_VALUE_ENCODING) };
+
+/* commands without data go to the interrupt out endpoint, if the device has one and it is enabled */
+/* off by default as on the host: the device acks such a packet on receipt, before it processed it */
+static bool out_endpoint = false;
+module_param(out_endpoint, bool, 0644);
+MODULE_PARM_DESC(out_endpoint, "send commands over the interrupt out endpoint instead of control transfers");
+
 /* tiny struct, as everything is asked from the device and not stored host side */
 struct flashtrig {
 	struct usb_device *udev;
+	struct urb *out_urb;			/* allocated once for the interrupt out endpoint */
+	u8 *out_buf;
+	struct mutex out_lock;
+	struct completion out_done;
 };
 
 
-static ssize_t send_cmd(struct device *dev, struct device_attribute *attr, char cmd, size_t count, int16_t *value)
+static void out_complete(struct urb *urb)
+{
+	struct flashtrig *ft = urb->context;
+
+	complete(&ft->out_done);
+}
+
+/* one command packet on the interrupt out endpoint, waits until the device took it */
+static int send_out(struct flashtrig *ft, char cmd, u16 wValue, u16 wIndex)
+{
+	int retval;
+
+	mutex_lock(&ft->out_lock);
+	ft->out_buf[0] = FT_OUT_COMMAND;
+	ft->out_buf[1] = cmd;
+	ft->out_buf[2] = wValue & 0xFF;
+	ft->out_buf[3] = wValue >> 8;
+	ft->out_buf[4] = wIndex & 0xFF;
+	ft->out_buf[5] = wIndex >> 8;
+
+	reinit_completion(&ft->out_done);
+	retval = usb_submit_urb(ft->out_urb, GFP_KERNEL);
+	if (!retval)
+	{
+		if (!wait_for_completion_timeout(&ft->out_done, msecs_to_jiffies(USB_CTRL_SET_TIMEOUT)))
+		{
+			usb_kill_urb(ft->out_urb);
+			retval = -ETIMEDOUT;
+		} else
+		{
+			retval = ft->out_urb->status;
+		}
+	}
+	mutex_unlock(&ft->out_lock);
+	return retval;
+}
+
+
+static ssize_t send_cmd(struct device *dev, struct device_attribute *attr, char cmd, size_t count, s32 *value)
 {
 	struct usb_interface *intf = to_usb_interface(dev);
 	struct flashtrig *ft = usb_get_intfdata(intf);
+	u16 wValue = 0;
+	u16 wIndex = 0;
 	int retval;
 
-	if (cmd == FT_CMD_FLASH_TIME_SET)
+	if (value && value_encoding[(u8)cmd] == FT_VAL_32)
 	{
-		retval = usb_control_msg(ft->udev, 				// *dev
-			usb_sndctrlpipe(ft->udev, 0),				// pipe
-			cmd,										// request
-			USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_OTHER, // requestType
-			*value, /* flash time */					// value
-			0, 											// index
-			NULL, 										// data
-			0, 											// size
-			USB_CTRL_GET_TIMEOUT);						// timeout
+		/* 32 bit values, split over value and index */
+		wValue = *value & 0xFFFF;
+		wIndex = (u32)*value >> 16;
 
-	} else {
+	} else if (value)
+	{
+		wValue = *value; /* e.g. flash time in ms or channel mask */
+	}
 
-		retval = usb_control_msg(ft->udev, 				// *dev
-			usb_sndctrlpipe(ft->udev, 0),				// pipe
-			cmd, 										// request
-			USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_OTHER, // requestType
-			0, 											// value
-			0, 											// index
-			NULL, 										// data
-			0, 											// size
-			USB_CTRL_GET_TIMEOUT);						// timeout
+	if (ft->out_urb && out_endpoint)
+		return send_out(ft, cmd, wValue, wIndex);
+
+	retval = usb_control_msg(ft->udev, 					// *dev
+		usb_sndctrlpipe(ft->udev, 0),					// pipe
+		cmd,											// request
+		FT_REQ_OUT,										// requestType
+		wValue,											// value
+		wIndex,											// index
+		NULL, 											// data
+		0, 												// size
+		USB_CTRL_GET_TIMEOUT);							// timeout
 
-	}
-	
 	return retval;
 }
 
-static ssize_t rec_cmd(struct device *dev, struct device_attribute *attr, char cmd, size_t count, int16_t *value)
+/* fetches a reply of up to size bytes into data, returns the received length */
+static int rec_data(struct device *dev, char cmd, u8 *data, int size)
 {
 	struct usb_interface *intf = to_usb_interface(dev);
 	struct flashtrig *ft = usb_get_intfdata(intf);
 	int retval;
-	u8 *buf = kmalloc(2, GFP_KERNEL);
+	u8 *buf = kmalloc(size, GFP_KERNEL);
+
+	if (!buf)
+		return -ENOMEM;
 
 	retval = usb_control_msg(ft->udev, 
 				usb_rcvctrlpipe(ft->udev, 0), 
 				cmd, 
-				USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+				FT_REQ_IN,
 				0, 
 				0,
 				buf, 
-				2,
+				size,
 				USB_CTRL_GET_TIMEOUT);
 
+	if (retval > 0)
+		memcpy(data, buf, retval);
+
+	kfree(buf);
+	return retval;
+}
+
+/* fetches the status block of FT_STATUS_SIZE bytes, returns 0 on success */
+static int rec_status(struct device *dev, u8 *status)
+{
+	int retval = rec_data(dev, FT_CMD_STATUS, status, FT_STATUS_SIZE);
+
+	if (retval < 0)
+		return retval;
+	if (retval != FT_STATUS_SIZE || status[0] < 1 || status[1] < FT_STATUS_SIZE)
+		return -EIO;
+	return 0;
+}
+
+static u32 status_u32(const u8 *p)
+{
+	return ((u32)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
 
-	if (cmd == FT_CMD_FLASH_TIME_GET)
+static ssize_t flash_time_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u8 status[FT_STATUS_SIZE];
+	if (rec_status(dev, status))
 	{
-		*value = buf[1];
-		*value |= buf[0] << 8;
+		return sprintf(buf, "error fetching flash time\n");
+	}
+	return sprintf(buf, "%u\n", min_t(u32, status_u32(status + 4) / 1000, 0xFFFF));
+}
 
-	} else if (cmd == FT_CMD_LIGHT_STATE)
+static ssize_t flash_time_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u8 status[FT_STATUS_SIZE];
+	if (rec_status(dev, status))
 	{
-		*value = buf[0];
+		return sprintf(buf, "error fetching flash time\n");
 	}
+	return sprintf(buf, "%u\n", status_u32(status + 4));
+}
 
-	return retval;
+static ssize_t channel_state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u8 status[FT_STATUS_SIZE];
+	if (rec_status(dev, status))
+	{
+		return sprintf(buf, "error fetching channel state\n");
+	}
+	return sprintf(buf, "0x%02x\n", status[2]);
+}
+
+static ssize_t status_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	// everything of the status block, one "name value" per line
+	u8 status[FT_STATUS_SIZE];
+	if (rec_status(dev, status))
+	{
+		return sprintf(buf, "error fetching status\n");
+	}
+	return sprintf(buf,
+		"version %u\nchannels 0x%02x\nflags 0x%02x\nflash_time_us %u\nflash_left_us %u\n"
+		"sequence_state %u\nsequence_index %u\nsequence_runs %u\ndevice_time %u\n",
+		status[0], status[2], status[3], status_u32(status + 4), status_u32(status + 8),
+		status[12], status[13], (status[14] << 8) | status[15], status_u32(status + 16));
 }
 
+static ssize_t clock_calibration_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	// correction of the device timer against the usb frames, in parts per billion
+	u8 data[FT_CMD_CLOCK_GET_LEN];
+	s32 correction, last;
+	if (rec_data(dev, FT_CMD_CLOCK_GET, data, sizeof(data)) != sizeof(data))
+	{
+		return sprintf(buf, "error fetching clock calibration\n");
+	}
+	// the device keeps them within 2^15 of FT_CLOCK_SCALE, 1e9 / 2^24 is 59.605
+	correction = (s32)status_u32(data) * 59605 / 1000;
+	last = (s32)status_u32(data + 4) * 59605 / 1000;
+	return sprintf(buf, "correction_ppb %d\nlast_ppb %d\nwindows %u\n",
+		correction, last, (data[8] << 8) | data[9]);
+}
 
-static ssize_t flash_time_show(struct device *dev, struct device_attribute *attr, char *buf)
+static ssize_t channel_time_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int16_t val = -1;
-	rec_cmd(dev, attr, FT_CMD_FLASH_TIME_GET, 1, &val);
-	if (val == -1)
+	u8 data[FT_CMD_CHANNEL_GET_LEN];
+	int i, len = 0;
+	if (rec_data(dev, FT_CMD_CHANNEL_GET, data, sizeof(data)) != sizeof(data))
 	{
-		return sprintf(buf, "error fetching flash time\n");
+		return sprintf(buf, "error fetching channel times\n");
+	}
+	for (i = 0; i < FT_CHANNELS; i++)
+	{
+		len += sprintf(buf + len, "%u%c", (data[1 + 2 * i] << 8) | data[2 + 2 * i],
+			i == FT_CHANNELS - 1 ? '\n' : ' ');
 	}
-	return sprintf(buf, "%d\n", val);
+	return len;
+}
+
+static ssize_t ext_trigger_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	// flags, debounce and the last event: counter, device time of the edge, ticks to fire
+	u8 data[FT_CMD_EXT_STATUS_LEN];
+	if (rec_data(dev, FT_CMD_EXT_STATUS, data, sizeof(data)) != sizeof(data))
+	{
+		return sprintf(buf, "error fetching external trigger state\n");
+	}
+	return sprintf(buf, "0x%02x %u %u %u %u\n", data[0], (data[1] << 8) | data[2], data[4],
+		((u32)data[5] << 24) | (data[6] << 16) | (data[7] << 8) | data[8],
+		(data[9] << 8) | data[10]);
+}
+
+static ssize_t shutter_lag_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	// the lags of the last shots in us, oldest first, 0 if not measured
+	u8 data[FT_CMD_LAG_GET_LEN];
+	u32 ticks;
+	int i, len = 0;
+	if (rec_data(dev, FT_CMD_LAG_GET, data, sizeof(data)) != sizeof(data))
+	{
+		return sprintf(buf, "error fetching shutter lag\n");
+	}
+	for (i = 0; i < FT_LAG_SAMPLES; i++)
+	{
+		ticks = ((u32)data[1 + 4 * i] << 24) | (data[2 + 4 * i] << 16) | (data[3 + 4 * i] << 8) | data[4 + 4 * i];
+		len += sprintf(buf + len, "%u%c", ticks * 10 / (FT_TIMER_TICKS_PER_MS / 100),
+			i == FT_LAG_SAMPLES - 1 ? '\n' : ' ');
+	}
+	return len;
+}
+
+static ssize_t light_lead_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u8 data[FT_CMD_LIGHT_LEAD_GET_LEN];
+	if (rec_data(dev, FT_CMD_LIGHT_LEAD_GET, data, sizeof(data)) != sizeof(data))
+	{
+		return sprintf(buf, "error fetching light lead\n");
+	}
+	return sprintf(buf, "%u %u\n", (data[0] << 8) | data[1], (data[2] << 8) | data[3]);
 }
 
 static ssize_t light_state_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-	int16_t val = 2;
-	rec_cmd(dev, attr, FT_CMD_LIGHT_STATE, 1, &val); 
-	if (val == 2)
+	u8 status[FT_STATUS_SIZE];
+	if (rec_status(dev, status))
 	{
 		return sprintf(buf, "error fetching light state\n");
 	}
-	return sprintf(buf, "%d\n", val);
+	return sprintf(buf, "%d\n", (status[2] & FT_CH_FLASH) ? 1 : 0);
 }
 
 
@@ -153,7 +330,7 @@ static ssize_t light_off_store(struct device *dev, struct device_attribute *attr
 static ssize_t flash_time_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
 	// sets the time of the "flash" being on 16 bit, 1ms resolution
-	int16_t value;
+	s32 value;
 	int i, mult;
 	value = 0;
 	mult = 1;
@@ -167,6 +344,190 @@ static ssize_t flash_time_store(struct device *dev, struct device_attribute *att
 	return count;
 }
 
+static ssize_t flash_time_us_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// sets the time of the "flash" being on 32 bit, 1us resolution
+	u32 value;
+	int retval;
+
+	retval = kstrtou32(buf, 10, &value);
+	if (retval)
+		return retval;
+
+	send_cmd(dev, attr, FT_CMD_FLASH_TIME_US_SET, 1, (s32 *)&value);
+	return count;
+}
+
+
+static ssize_t prefocus_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// half press hold time in ms, 0 uses the focus channel time
+	u16 ms;
+	s32 value;
+	int retval;
+
+	retval = kstrtou16(buf, 10, &ms);
+	if (retval)
+		return retval;
+
+	value = ms;
+	send_cmd(dev, attr, FT_CMD_PREFOCUS, 1, &value);
+	return count;
+}
+
+static ssize_t focus_fire_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// delay from the half press to the armed shot in ms
+	u16 ms;
+	s32 value;
+	int retval;
+
+	retval = kstrtou16(buf, 10, &ms);
+	if (retval)
+		return retval;
+
+	value = ms;
+	send_cmd(dev, attr, FT_CMD_FOCUS_FIRE, 1, &value);
+	return count;
+}
+
+
+static ssize_t channel_mask_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count, char cmd)
+{
+	// a mask of FT_CH_*, decimal or 0x prefixed
+	u8 mask;
+	s32 value;
+	int retval;
+
+	retval = kstrtou8(buf, 0, &mask);
+	if (retval)
+		return retval;
+
+	value = mask;
+	send_cmd(dev, attr, cmd, 1, &value);
+	return count;
+}
+
+static ssize_t channel_on_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	return channel_mask_store(dev, attr, buf, count, FT_CMD_CHANNEL_ON);
+}
+
+static ssize_t channel_off_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	return channel_mask_store(dev, attr, buf, count, FT_CMD_CHANNEL_OFF);
+}
+
+static ssize_t channel_pulse_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	return channel_mask_store(dev, attr, buf, count, FT_CMD_CHANNEL_PULSE);
+}
+
+static ssize_t channel_time_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// "<channel> <ms>", the pulse time of one channel
+	unsigned int channel, ms;
+	s32 value;
+
+	if (sscanf(buf, "%u %u", &channel, &ms) != 2 || channel >= FT_CHANNELS || ms > 0xFFFF)
+		return -EINVAL;
+
+	value = (channel << 16) | ms;
+	send_cmd(dev, attr, FT_CMD_CHANNEL_TIME_SET, 1, &value);
+	return count;
+}
+
+static ssize_t ext_trigger_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// "<flags> <debounce ms>", flags a mask of FT_EXT_*, 0 disarms
+	unsigned int flags, ms;
+	s32 value;
+
+	if (sscanf(buf, "%i %u", &flags, &ms) != 2 || flags > 0xFF || ms > 0xFFFF)
+		return -EINVAL;
+
+	value = (ms << 16) | flags;
+	send_cmd(dev, attr, FT_CMD_EXT_ARM, 1, &value);
+	return count;
+}
+
+static ssize_t shutter_lag_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// a mask of FT_LAG_*, 0 turns the measurement off
+	u8 flags;
+	s32 value;
+	int retval;
+
+	retval = kstrtou8(buf, 0, &flags);
+	if (retval)
+		return retval;
+
+	value = flags;
+	send_cmd(dev, attr, FT_CMD_LAG_SETUP, 1, &value);
+	return count;
+}
+
+static ssize_t strobe_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// "<period us> <on us> <pulses> [<trigger delay ms>]", "0" stops the strobe
+	unsigned int period, on, pulses, delay;
+	struct usb_interface *intf = to_usb_interface(dev);
+	struct flashtrig *ft = usb_get_intfdata(intf);
+	u8 *data;
+	s32 value;
+	int n, retval;
+
+	n = sscanf(buf, "%u %u %u %u", &period, &on, &pulses, &delay);
+	if (n == 1 && period == 0)
+	{
+		value = 0;
+		send_cmd(dev, attr, FT_CMD_STROBE_RUN, 1, &value);
+		return count;
+	}
+	if (n < 3 || pulses > 0xFFFF || (n == 4 && delay > 0xFFFF))
+		return -EINVAL;
+
+	data = kmalloc(FT_STROBE_SIZE, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+	data[0] = period >> 24;
+	data[1] = period >> 16;
+	data[2] = period >> 8;
+	data[3] = period;
+	data[4] = on >> 24;
+	data[5] = on >> 16;
+	data[6] = on >> 8;
+	data[7] = on;
+	data[8] = pulses >> 8;
+	data[9] = pulses;
+
+	retval = usb_control_msg(ft->udev, usb_sndctrlpipe(ft->udev, 0), FT_CMD_STROBE_SET,
+		FT_REQ_OUT, 0, 0, data, FT_CMD_STROBE_SET_LEN, USB_CTRL_SET_TIMEOUT);
+	kfree(data);
+	if (retval < 0)
+		return retval;
+
+	value = FT_STROBE_RUN;
+	if (n == 4)
+		value |= FT_STROBE_WITH_TRIGGER | (delay << 16);
+	send_cmd(dev, attr, FT_CMD_STROBE_RUN, 1, &value);
+	return count;
+}
+
+static ssize_t light_lead_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	// "<lead ms> <tail ms>", light on before and after the trigger of flash
+	unsigned int lead, tail;
+	s32 value;
+
+	if (sscanf(buf, "%u %u", &lead, &tail) != 2 || lead > 0xFFFF || tail > 0xFFFF)
+		return -EINVAL;
+
+	value = (tail << 16) | lead;
+	send_cmd(dev, attr, FT_CMD_LIGHT_LEAD_SET, 1, &value);
+	return count;
+}
+
 
 static DEVICE_ATTR_WO(trigger);
 static DEVICE_ATTR_WO(flash);
@@ -174,12 +535,27 @@ static DEVICE_ATTR_WO(light_on);
 static DEVICE_ATTR_WO(light_off);
 static DEVICE_ATTR_RO(light_state);
 static DEVICE_ATTR_RW(flash_time);
+static DEVICE_ATTR_RW(flash_time_us);
+static DEVICE_ATTR_WO(channel_on);
+static DEVICE_ATTR_WO(channel_off);
+static DEVICE_ATTR_WO(channel_pulse);
+static DEVICE_ATTR_RO(channel_state);
+static DEVICE_ATTR_RW(channel_time);
+static DEVICE_ATTR_RW(ext_trigger);
+static DEVICE_ATTR_WO(prefocus);
+static DEVICE_ATTR_WO(focus_fire);
+static DEVICE_ATTR_RW(shutter_lag);
+static DEVICE_ATTR_RW(light_lead);
+static DEVICE_ATTR_WO(strobe);
+static DEVICE_ATTR_RO(status);
+static DEVICE_ATTR_RO(clock_calibration);
 
 
 static int ft_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {
 	struct usb_device *udev = interface_to_usbdev(interface);
 	struct usb_device_descriptor *buf;
+	struct usb_endpoint_descriptor *out;
 
 	struct flashtrig *dev;
 	int retval;
@@ -196,6 +572,20 @@ static int ft_probe(struct usb_interface *interface, const struct usb_device_id
 
 	kfree(buf);
 
+	// firmware with the interrupt out endpoint takes the commands there
+	mutex_init(&dev->out_lock);
+	init_completion(&dev->out_done);
+	if (!usb_find_int_out_endpoint(interface->cur_altsetting, &out))
+	{
+		dev->out_urb = usb_alloc_urb(0, GFP_KERNEL);
+		dev->out_buf = kmalloc(FT_OUT_SIZE, GFP_KERNEL);
+		if (!dev->out_urb || !dev->out_buf) {
+			retval = -ENOMEM;
+			goto error;
+		}
+		usb_fill_int_urb(dev->out_urb, udev, usb_sndintpipe(udev, usb_endpoint_num(out)),
+			dev->out_buf, FT_OUT_SIZE, out_complete, dev, out->bInterval);
+	}
 
 	dev->udev = usb_get_dev(udev);
 	usb_set_intfdata(interface, dev);
@@ -203,9 +593,23 @@ static int ft_probe(struct usb_interface *interface, const struct usb_device_id
 	retval = device_create_file(&interface->dev, &dev_attr_trigger);
 	retval = device_create_file(&interface->dev, &dev_attr_flash);
 	retval = device_create_file(&interface->dev, &dev_attr_flash_time);
+	retval = device_create_file(&interface->dev, &dev_attr_flash_time_us);
 	retval = device_create_file(&interface->dev, &dev_attr_light_on);
 	retval = device_create_file(&interface->dev, &dev_attr_light_off);
 	retval = device_create_file(&interface->dev, &dev_attr_light_state);
+	retval = device_create_file(&interface->dev, &dev_attr_channel_on);
+	retval = device_create_file(&interface->dev, &dev_attr_channel_off);
+	retval = device_create_file(&interface->dev, &dev_attr_channel_pulse);
+	retval = device_create_file(&interface->dev, &dev_attr_channel_state);
+	retval = device_create_file(&interface->dev, &dev_attr_channel_time);
+	retval = device_create_file(&interface->dev, &dev_attr_ext_trigger);
+	retval = device_create_file(&interface->dev, &dev_attr_prefocus);
+	retval = device_create_file(&interface->dev, &dev_attr_focus_fire);
+	retval = device_create_file(&interface->dev, &dev_attr_shutter_lag);
+	retval = device_create_file(&interface->dev, &dev_attr_light_lead);
+	retval = device_create_file(&interface->dev, &dev_attr_strobe);
+	retval = device_create_file(&interface->dev, &dev_attr_status);
+	retval = device_create_file(&interface->dev, &dev_attr_clock_calibration);
 	if (retval)
 		goto error_create_file;
 
@@ -215,6 +619,10 @@ error_create_file:
 	usb_put_dev(udev);
 	usb_set_intfdata(interface, NULL);
 error:
+	if (dev) {
+		usb_free_urb(dev->out_urb);
+		kfree(dev->out_buf);
+	}
 	kfree(dev);
 	return retval;
 }
@@ -227,10 +635,27 @@ static void ft_disconnect(struct usb_interface *interface)
 	device_remove_file(&interface->dev, &dev_attr_trigger);
 	device_remove_file(&interface->dev, &dev_attr_flash);
 	device_remove_file(&interface->dev, &dev_attr_flash_time);
+	device_remove_file(&interface->dev, &dev_attr_flash_time_us);
 	device_remove_file(&interface->dev, &dev_attr_light_on);
 	device_remove_file(&interface->dev, &dev_attr_light_off);
 	device_remove_file(&interface->dev, &dev_attr_light_state);
+	device_remove_file(&interface->dev, &dev_attr_channel_on);
+	device_remove_file(&interface->dev, &dev_attr_channel_off);
+	device_remove_file(&interface->dev, &dev_attr_channel_pulse);
+	device_remove_file(&interface->dev, &dev_attr_channel_state);
+	device_remove_file(&interface->dev, &dev_attr_channel_time);
+	device_remove_file(&interface->dev, &dev_attr_ext_trigger);
+	device_remove_file(&interface->dev, &dev_attr_prefocus);
+	device_remove_file(&interface->dev, &dev_attr_focus_fire);
+	device_remove_file(&interface->dev, &dev_attr_shutter_lag);
+	device_remove_file(&interface->dev, &dev_attr_light_lead);
+	device_remove_file(&interface->dev, &dev_attr_strobe);
+	device_remove_file(&interface->dev, &dev_attr_status);
+	device_remove_file(&interface->dev, &dev_attr_clock_calibration);
 	usb_set_intfdata(interface, NULL);
+	usb_kill_urb(dev->out_urb);
+	usb_free_urb(dev->out_urb);
+	kfree(dev->out_buf);
 	usb_put_dev(dev->udev);
 	kfree(dev);
 }